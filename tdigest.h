@@ -19,9 +19,19 @@
 #define TDIGEST2_TDIGEST_H_
 
 #include <algorithm>
+#include <array>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
 #include <queue>
+#include <random>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -35,6 +45,9 @@ using Index = size_t;
 
 const size_t kHighWater = 40000;
 
+// buffers at least this long are radix sorted, shorter ones go through std::sort
+const size_t kRadixSortThreshold = 2048;
+
 class Centroid {
  public:
   Centroid() : Centroid(0.0, 0.0) {}
@@ -62,9 +75,22 @@ class Centroid {
 };
 
 struct CentroidList {
-  CentroidList(const std::vector<Centroid>& s) : iter(s.cbegin()), end(s.cend()) {}
+  CentroidList(const std::vector<Centroid>& s, Weight scale = 1, Value meanScale = 1, Value meanOffset = 0)
+      : iter(s.cbegin()), end(s.cend()), scale(scale), meanScale(meanScale), meanOffset(meanOffset) {}
   std::vector<Centroid>::const_iterator iter;
   std::vector<Centroid>::const_iterator end;
+  // multiplier for the weights of the list, and the increasing affine map for its means
+  Weight scale;
+  Value meanScale;
+  Value meanOffset;
+
+  // the mean of the current centroid after the map, which is what the merge orders lists by
+  Value mean() const { return iter->mean() * meanScale + meanOffset; }
+
+  Centroid current() const {
+    if (scale == 1 && meanScale == 1 && meanOffset == 0) return *iter;
+    return Centroid(mean(), iter->weight() * scale);
+  }
 
   bool advance() { return ++iter != end; }
 };
@@ -74,7 +100,7 @@ class CentroidListComparator {
   CentroidListComparator() {}
 
   bool operator()(const CentroidList& left, const CentroidList& right) const {
-    return left.iter->mean() > right.iter->mean();
+    return left.mean() > right.mean();
   }
 };
 
@@ -84,6 +110,203 @@ struct CentroidComparator {
   bool operator()(const Centroid& a, const Centroid& b) const { return a.mean() < b.mean(); }
 };
 
+// a centroid whose mean has been mapped to an unsigned integer with the same ordering, so that sorting can
+// compare (or bucket) plain integers and carry the weight along as the payload
+struct CentroidKey {
+  uint64_t key;
+  Weight weight;
+};
+
+inline uint64_t toSortKey(Value mean) noexcept {
+  uint64_t bits;
+  std::memcpy(&bits, &mean, sizeof(bits));
+  // flip every bit of negatives and only the sign bit of positives
+  return bits ^ (static_cast<uint64_t>(static_cast<int64_t>(bits) >> 63) | 0x8000000000000000ULL);
+}
+
+inline Value fromSortKey(uint64_t key) noexcept {
+  uint64_t bits = key ^ (((key >> 63) - 1) | 0x8000000000000000ULL);
+  Value mean;
+  std::memcpy(&mean, &bits, sizeof(mean));
+  return mean;
+}
+
+// fold the bits of x into the running fingerprint h.  the splitmix64 finalizer makes the result depend on the order
+// of the values as well as on the values themselves.
+inline uint64_t fingerprintMix(uint64_t h, Value x) noexcept {
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  uint64_t z = (h ^ bits) + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// LSD radix sort of n items on the 64 bit unsigned key returned by keyOf, a byte at a time, skipping bytes that are
+// the same for every key.  items and scratch are both overwritten; the returned pointer is whichever of the two
+// holds the sorted result.
+template <typename T, typename KeyOf>
+inline T* radixSort(T* items, T* scratch, size_t n, KeyOf keyOf) {
+  size_t counts[8][256] = {};
+  for (size_t i = 0; i < n; i++) {
+    const uint64_t key = keyOf(items[i]);
+    for (int b = 0; b < 8; b++) counts[b][(key >> (8 * b)) & 0xff]++;
+  }
+
+  T* src = items;
+  T* dst = scratch;
+  for (int b = 0; b < 8 && n > 0; b++) {
+    auto& count = counts[b];
+    if (count[(keyOf(src[0]) >> (8 * b)) & 0xff] == n) continue;
+    size_t offset = 0;
+    for (auto& c : count) {
+      const size_t next = offset + c;
+      c = offset;
+      offset = next;
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[count[(keyOf(src[i]) >> (8 * b)) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+  return src;
+}
+
+// sort centroids by mean.  long buffers are converted to (key, weight) pairs and radix sorted; keys and scratch are
+// caller owned so they can be reused.
+inline void sortCentroids(std::vector<Centroid>& centroids, std::vector<CentroidKey>& keys,
+                          std::vector<CentroidKey>& scratch) {
+  const size_t n = centroids.size();
+  if (n < kRadixSortThreshold) {
+    std::sort(centroids.begin(), centroids.end(), CentroidComparator());
+    return;
+  }
+
+  keys.resize(n);
+  scratch.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = CentroidKey{toSortKey(centroids[i].mean()), centroids[i].weight()};
+  }
+  auto sorted = radixSort(keys.data(), scratch.data(), n, [](const CentroidKey& k) { return k.key; });
+  for (size_t i = 0; i < n; i++) {
+    centroids[i] = Centroid(fromSortKey(sorted[i].key), sorted[i].weight);
+  }
+}
+
+// collapse the sorted run [begin, end) into one centroid.  means are summed relative to the first mean so that
+// runs of identical values stay exact, and there is a single division for the whole run.
+inline Centroid reduceCentroids(const Centroid* begin, const Centroid* end) {
+  if (end - begin == 1) return *begin;
+  const Value base = begin->mean();
+  Weight w = 0;
+  Value dm = 0;
+  for (auto iter = begin; iter != end; iter++) {
+    w += iter->weight();
+    dm += iter->weight() * (iter->mean() - base);
+  }
+  return (w > 0) ? Centroid(base + dm / w, w) : *begin;
+}
+
+// Exact count, sum, mean, variance and extremes of everything added to a digest.  The sum is compensated (Kahan),
+// the variance follows Welford's weighted update, and two sets of moments combine with Chan et al.'s pairwise
+// formula, so merging digests loses nothing.
+class Moments {
+ public:
+  Moments() {}
+
+  Moments(Weight count, Value sum, Value mean, Value m2, Value min, Value max)
+      : count_(count), sum_(sum), mean_(mean), m2_(m2), min_(min), max_(max) {}
+
+  Weight count() const { return count_; }
+
+  Value sum() const { return sum_ - compensation_; }
+
+  Value mean() const { return (count_ > 0) ? mean_ : NAN; }
+
+  // sum of squared deviations from the mean
+  Value m2() const { return m2_; }
+
+  Value sumOfSquares() const { return m2_ + count_ * mean_ * mean_; }
+
+  // population variance
+  Value variance() const { return (count_ > 0) ? m2_ / count_ : NAN; }
+
+  Value stddev() const { return std::sqrt(variance()); }
+
+  Value min() const { return (count_ > 0) ? min_ : NAN; }
+
+  Value max() const { return (count_ > 0) ? max_ : NAN; }
+
+  // the same samples with every weight multiplied by factor
+  Moments scaled(Weight factor) const {
+    Moments moments = *this;
+    moments.count_ *= factor;
+    moments.sum_ *= factor;
+    moments.compensation_ *= factor;
+    moments.m2_ *= factor;
+    return moments;
+  }
+
+  // the same samples mapped through x -> scale * x + offset, for scale > 0
+  Moments transformed(Value scale, Value offset) const {
+    if (count_ <= 0) return *this;
+    Moments moments = *this;
+    moments.sum_ = scale * sum_ + offset * count_;
+    moments.compensation_ = scale * compensation_;
+    moments.mean_ = scale * mean_ + offset;
+    moments.m2_ = scale * scale * m2_;
+    moments.min_ = scale * min_ + offset;
+    moments.max_ = scale * max_ + offset;
+    return moments;
+  }
+
+  inline void add(Value x, Weight w) {
+    if (w <= 0) return;
+    count_ += w;
+    const Value delta = x - mean_;
+    mean_ += delta * w / count_;
+    m2_ += w * delta * (x - mean_);
+    addToSum(x * w);
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+  }
+
+  void merge(const Moments& o) {
+    if (o.count_ <= 0) return;
+    const Weight count = count_ + o.count_;
+    const Value delta = o.mean_ - mean_;
+    mean_ += delta * o.count_ / count;
+    m2_ += o.m2_ + delta * delta * count_ * o.count_ / count;
+    count_ = count;
+    addToSum(o.sum_);
+    addToSum(-o.compensation_);
+    min_ = std::min(min_, o.min_);
+    max_ = std::max(max_, o.max_);
+  }
+
+ private:
+  Weight count_ = 0;
+
+  Value sum_ = 0;
+
+  Value compensation_ = 0;
+
+  Value mean_ = 0;
+
+  Value m2_ = 0;
+
+  Value min_ = std::numeric_limits<Value>::infinity();
+
+  Value max_ = -std::numeric_limits<Value>::infinity();
+
+  inline void addToSum(Value x) {
+    const Value y = x - compensation_;
+    const Value t = sum_ + y;
+    compensation_ = (t - sum_) - y;
+    sum_ = t;
+  }
+};
+
 class TDigest {
   class TDigestComparator {
    public:
@@ -121,6 +344,27 @@ class TDigest {
       min_ = std::min(min_, processed_[0].mean());
       max_ = std::max(max_, (processed_.cend() - 1)->mean());
     }
+
+    // without saved moments, the centroids give the exact count and sum, but only the spread between centroids
+    for (auto& centroid : processed_) moments_.add(centroid.mean(), centroid.weight());
+    for (auto& centroid : unprocessed_) moments_.add(centroid.mean(), centroid.weight());
+    updateCumulative();
+  }
+
+  // restore a digest together with the moments saved alongside its centroids
+  TDigest(std::vector<Centroid>&& processed, std::vector<Centroid>&& unprocessed, Value compression,
+          Index unmergedSize, Index mergedSize, const Moments& moments)
+      : TDigest(std::move(processed), std::move(unprocessed), compression, unmergedSize, mergedSize) {
+    moments_ = moments;
+    updateCumulative();
+  }
+
+  // restore a digest together with the exact extremes of its samples, which the centroid means only bound
+  TDigest(std::vector<Centroid>&& processed, std::vector<Centroid>&& unprocessed, Value compression,
+          Index unmergedSize, Index mergedSize, Value min, Value max)
+      : TDigest(std::move(processed), std::move(unprocessed), compression, unmergedSize, mergedSize) {
+    min_ = std::min(min_, min);
+    max_ = std::max(max_, max);
     updateCumulative();
   }
 
@@ -143,12 +387,46 @@ class TDigest {
     cumulative_ = std::move(o.cumulative_);
     min_ = o.min_;
     max_ = o.max_;
+    denseLow_ = o.denseLow_;
+    densePending_ = o.densePending_;
+    denseCounts_ = std::move(o.denseCounts_);
+    moments_ = o.moments_;
+    tailSize_ = o.tailSize_;
+    lowTail_ = std::move(o.lowTail_);
+    highTail_ = std::move(o.highTail_);
+    lowSorted_ = std::move(o.lowSorted_);
+    highSorted_ = std::move(o.highSorted_);
+    watchers_ = std::move(o.watchers_);
+    fingerprint_ = o.fingerprint_;
+    generation_ = o.generation_;
+    weightScale_ = o.weightScale_;
+    valueScale_ = o.valueScale_;
+    valueOffset_ = o.valueOffset_;
+    logUnit_ = o.logUnit_;
+    strictBound_ = o.strictBound_;
     return *this;
   }
 
   TDigest(TDigest&& o)
       : TDigest(std::move(o.processed_), std::move(o.unprocessed_), o.compression_, o.maxUnprocessed_,
-                o.maxProcessed_) {}
+                o.maxProcessed_) {
+    unprocessedWeight_ = o.unprocessedWeight_;
+    denseLow_ = o.denseLow_;
+    densePending_ = o.densePending_;
+    denseCounts_ = std::move(o.denseCounts_);
+    moments_ = o.moments_;
+    tailSize_ = o.tailSize_;
+    lowTail_ = std::move(o.lowTail_);
+    highTail_ = std::move(o.highTail_);
+    watchers_ = std::move(o.watchers_);
+    generation_ = o.generation_;
+    weightScale_ = o.weightScale_;
+    valueScale_ = o.valueScale_;
+    valueOffset_ = o.valueOffset_;
+    logUnit_ = o.logUnit_;
+    strictBound_ = o.strictBound_;
+    updateCumulative();
+  }
 
   static inline Index processedSize(Index size, Value compression) noexcept {
     return (size == 0) ? static_cast<Index>(2 * std::ceil(compression)) : size;
@@ -158,12 +436,81 @@ class TDigest {
     return (size == 0) ? static_cast<Index>(8 * std::ceil(compression)) : size;
   }
 
+  // the steady state footprint in bytes of a digest at compression with the default buffer sizes: the object with
+  // its full processed, cumulative and unprocessed vectors
+  static size_t memoryBytes(Value compression) noexcept {
+    return sizeof(TDigest) + processedSize(0, compression) * (sizeof(Centroid) + sizeof(Weight)) +
+           (unprocessedSize(0, compression) + 1) * sizeof(Centroid);
+  }
+
   // merge in another t-digest
   inline void merge(const TDigest* other) {
     std::vector<const TDigest*> others{other};
     add(others.cbegin(), others.cend());
   }
 
+  // merge in another t-digest as if each of its weights were multiplied by weightFactor
+  inline void merge(const TDigest* other, Weight weightFactor) {
+    std::vector<const TDigest*> others{other};
+    add(others.cbegin(), others.cend(), weightFactor);
+  }
+
+  // multiply every weight, past and future, by factor in O(1).  the centroids keep their stored weights and the
+  // factor is applied wherever weights leave the digest: merges into other digests, weight and count queries,
+  // moments() and the bucket exporters.  quantiles and cdf values do not depend on it.  processed() and
+  // unprocessed() expose the stored weights, to be multiplied by weightScale() when serialized.
+  void scaleWeights(Weight factor) {
+    CHECK_GT(factor, 0);
+    weightScale_ *= factor;
+    generation_++;
+  }
+
+  Weight weightScale() const { return weightScale_; }
+
+  // map every value, past and future, through x -> scale * x + offset in O(1), for unit conversions and clock
+  // offsets.  the stored means stay as they are and the map is applied to whatever values go in or come out:
+  // quantiles, cdf arguments, moments(), the range and bucket queries, samples added afterwards and merges into
+  // other digests.  watchers keep the same threshold t, scale * t + offset in the new units.  a dense digest
+  // leaves dense mode first, since its counts sit on integer stored values.
+  void transformValues(Value scale, Value offset) {
+    CHECK_GT(scale, 0);
+    if (dense()) leaveDense();
+    valueOffset_ = scale * valueOffset_ + offset;
+    valueScale_ *= scale;
+    generation_++;
+  }
+
+  Value valueScale() const { return valueScale_; }
+
+  Value valueOffset() const { return valueOffset_; }
+
+  // store every value x as sign(x) * log(1 + |x| / unit) and compress in that domain, mapping back on the way out.
+  // a centroid then spans a fixed relative width instead of a fixed share of the range, which gives values well
+  // above unit in magnitude the same relative accuracy from far fewer centroids when the data spans orders of
+  // magnitude.  zero and negative values map through the same increasing function.  quantiles and cdf values
+  // interpolate in the log domain; the distance metrics and multi-digest split points still interpolate linearly
+  // between knots.  must be called on an empty digest that is not dense.
+  void setLogDomain(Value unit) {
+    CHECK_EQ(totalWeight(), 0);
+    CHECK_GT(unit, 0);
+    CHECK(!dense());
+    logUnit_ = unit;
+  }
+
+  // the unit of the log domain, 0 if values are stored as they are
+  Value logUnit() const { return logUnit_; }
+
+  // the value reported for a stored mean, and back
+  Value toValue(Value stored) const { return valueScale_ * decode(stored) + valueOffset_; }
+
+  Value toStored(Value x) const { return encode((x - valueOffset_) / valueScale_); }
+
+  static Value logEncode(Value x, Value unit) { return std::copysign(std::log1p(std::abs(x) / unit), x); }
+
+  static Value logDecode(Value stored, Value unit) {
+    return std::copysign(unit * std::expm1(std::abs(stored)), stored);
+  }
+
   const std::vector<Centroid>& processed() const { return processed_; }
 
   const std::vector<Centroid>& unprocessed() const { return unprocessed_; }
@@ -172,12 +519,45 @@ class TDigest {
 
   Index maxProcessed() const { return maxProcessed_; }
 
+  // hold the processed centroids to maxProcessed() after every call, merges and imports included, so a digest never
+  // needs more than maxProcessed() + maxUnprocessed() centroids.  the k1 limits of the compression fit within the
+  // default maxProcessed() of twice the compression; when they do not (a mergedSize below that), the digest is
+  // compressed again with the limits of a lower compression until it fits, and is then only as accurate as that
+  // lower compression.  exclusive with the dense domain.
+  void setStrictBound(bool strict) {
+    CHECK(!dense());
+    strictBound_ = strict;
+    if (processed_.size() > maxProcessed_) {
+      enforceBound();
+      updateCumulative();
+    }
+  }
+
+  bool strictBound() const { return strictBound_; }
+
   inline void add(std::vector<const TDigest*> digests) { add(digests.cbegin(), digests.cend()); }
 
   // merge in a vector of tdigests in the most efficient manner possible
   // in constant space
   // works for any value of kHighWater
-  void add(std::vector<const TDigest*>::const_iterator iter, std::vector<const TDigest*>::const_iterator end) {
+  // each digest's weights are multiplied by weightFactor and by its own weight scale on the way in
+  void add(std::vector<const TDigest*>::const_iterator iter, std::vector<const TDigest*>::const_iterator end,
+           Weight weightFactor = 1) {
+    generation_++;
+    for (auto td = iter; td != end; td++) {
+      const Weight factor = mergeFactor(**td, weightFactor);
+      Moments moments = (factor == 1) ? (*td)->moments_ : (*td)->moments_.scaled(factor);
+      moments_.merge(moments.transformed(mergeScale(**td), mergeOffset(**td)));
+      if (factor == 1) {
+        mergeTails(**td);
+      } else {
+        dropTails();
+      }
+    }
+    if (dense() && iter != end) {
+      if (mergeDense(iter, end, weightFactor)) return;
+      leaveDense();
+    }
     if (iter != end) {
       auto size = std::distance(iter, end);
       TDigestQueue pq(TDigestComparator{});
@@ -194,8 +574,8 @@ class TDigest {
         pq.pop();
         totalSize += td->totalSize();
         if (totalSize >= kHighWater || pq.empty()) {
-          mergeProcessed(batch);
-          mergeUnprocessed(batch);
+          mergeProcessed(batch, weightFactor);
+          mergeUnprocessed(batch, weightFactor);
           processIfNecessary();
           batch.clear();
           totalSize = 0;
@@ -205,15 +585,15 @@ class TDigest {
     }
   }
 
-  Weight processedWeight() const { return processedWeight_; }
+  Weight processedWeight() const { return processedWeight_ * weightScale_; }
 
-  Weight unprocessedWeight() const { return unprocessedWeight_; }
+  Weight unprocessedWeight() const { return unprocessedWeight_ * weightScale_; }
 
-  bool haveUnprocessed() const { return unprocessed_.size() > 0; }
+  bool haveUnprocessed() const { return unprocessed_.size() > 0 || densePending_; }
 
   size_t totalSize() const { return processed_.size() + unprocessed_.size(); }
 
-  long totalWeight() const { return static_cast<long>(processedWeight_ + unprocessedWeight_); }
+  long totalWeight() const { return static_cast<long>((processedWeight_ + unprocessedWeight_) * weightScale_); }
 
   // return the cdf on the t-digest
   Value cdf(Value x) {
@@ -221,226 +601,1312 @@ class TDigest {
     return cdfProcessed(x);
   }
 
-  bool isDirty() { return processed_.size() > maxProcessed_ || unprocessed_.size() > maxUnprocessed_; }
+  bool isDirty() {
+    return (processed_.size() > maxProcessed_ && !dense()) || unprocessed_.size() > maxUnprocessed_;
+  }
 
   // return the cdf on the processed values
-  Value cdfProcessed(Value x) const {
+  Value cdfProcessed(Value x) const { return cdfStored(toStored(x)); }
+
+  // this returns a quantile on the t-digest
+  Value quantile(Value q) {
+    if (haveUnprocessed() || isDirty()) process();
+    return quantileProcessed(q);
+  }
+
+  // this returns a quantile on the currently processed values without changing the t-digest
+  // the value will not represent the unprocessed values
+  Value quantileProcessed(Value q) const {
+    Value x;
+    if (tailQuantile(q, &x)) return toValue(x);
+    x = quantileOf(processed_.data(), cumulative_.data(), processed_.size(), processedWeight_, min_, max_, q);
+    return toValue(x);
+  }
+
+  Value compression() const { return compression_; }
+
+  // an estimate of the worst rank error of quantiles on the processed centroids: half the share of the weight held
+  // by the largest centroid, which the k1 scale puts at the median
+  Value rankError() const {
+    if (processedWeight_ == 0) return 0;
+    Weight largest = 0;
+    for (auto& c : processed_) largest = std::max(largest, c.weight());
+    return largest / (2 * processedWeight_);
+  }
+
+  // lower (or raise) the compression in place with a single pass of the compression loop over the processed
+  // centroids, which are already sorted.  buffer sizes go back to the defaults for the new compression.  a dense
+  // digest becomes an ordinary one.
+  void downsample(Value newCompression) {
+    if (dense()) leaveDense();
+    if (haveUnprocessed()) process();
+    compression_ = newCompression;
+    maxProcessed_ = processedSize(0, newCompression);
+    maxUnprocessed_ = unprocessedSize(0, newCompression);
+    processed_.reserve(maxProcessed_);
+    unprocessed_.reserve(maxUnprocessed_ + 1);
+    generation_++;
+    if (processed_.empty()) return;
+    unprocessed_.swap(processed_);
+    compressMerged();
+  }
+
+  // the same pass into out, an empty digest with the target compression, leaving this digest untouched.  the
+  // processed centroids are copied across by a merge of one sorted list, which compresses them on the way when they
+  // would outgrow out's processed limit, so they are neither sorted nor compressed again.
+  void downsample(TDigest* out) const {
+    CHECK_EQ(out->totalWeight(), 0);
+    std::vector<const TDigest*> self{this};
+    out->add(self.cbegin(), self.cend());
+    if (out->haveUnprocessed()) out->process();
+  }
+
+  void add(Value x) { add(x, 1); }
+
+  inline void compress() { process(); }
+
+  // add a single centroid to the unprocessed vector, processing previously unprocessed sorted if our limit has
+  // been reached.
+  inline bool add(Value x, Weight w) {
+    if (std::isnan(x)) {
+      return false;
+    }
+    if (weightScale_ != 1) {
+      w /= weightScale_;
+      dropTails();
+    }
+    if (mapped()) x = toStored(x);
+    // leave dense mode before observing a sample outside the domain, so the watchers recounted on the way out do
+    // not miss it
+    const bool counted = dense() && addDense(x, w);
+    if (dense() && !counted) leaveDense();
+    observe(x, w);
+    if (counted) return true;
+    unprocessed_.push_back(Centroid(x, w));
+    unprocessedWeight_ += w;
+    processIfNecessary();
+    return true;
+  }
+
+  inline void add(std::vector<Centroid>::const_iterator iter, std::vector<Centroid>::const_iterator end) {
+    while (dense() && iter != end) {
+      add(iter->mean(), iter->weight());
+      iter++;
+    }
+    while (iter != end) {
+      const size_t diff = std::distance(iter, end);
+      const size_t room = maxUnprocessed_ - unprocessed_.size();
+      auto mid = iter + std::min(diff, room);
+      if (weightScale_ != 1) dropTails();
+      while (iter != mid) {
+        const Weight w = iter->weight() / weightScale_;
+        const Value x = mapped() ? toStored(iter->mean()) : iter->mean();
+        observe(x, w);
+        unprocessedWeight_ += w;
+        unprocessed_.emplace_back(x, w);
+        iter++;
+      }
+      if (unprocessed_.size() >= maxUnprocessed_) {
+        process();
+      }
+    }
+  }
+
+  // return the cdf of x over the n sorted centroids starting at centroids, whose running half weights are in
+  // cumulative (n + 1 entries, as built by updateCumulative)
+  static Value cdfOf(const Centroid* centroids, const Weight* cumulative, Index n, Weight total, Value min,
+                     Value max, Value x) {
+    CentroidComparator cc;
+    auto i = std::distance(centroids, std::upper_bound(centroids, centroids + n, Centroid(x, 0), cc));
+    return cdfAt(centroids, cumulative, n, total, min, max, x, i);
+  }
+
+  // same as cdfOf, given the index i of the first centroid whose mean is above x
+  static Value cdfAt(const Centroid* centroids, const Weight* cumulative, Index n, Weight total, Value min,
+                     Value max, Value x, Index i) {
     VLOG(2) << "cdf value " << x;
-    VLOG(2) << "processed size " << processed_.size();
-    if (processed_.size() == 0) {
-      // no data to examin_e
+    VLOG(2) << "processed size " << n;
+    if (n == 0) {
+      // no data to examine
       VLOG(2) << "no processed values";
 
       return 0.0;
-    } else if (processed_.size() == 1) {
+    } else if (n == 1) {
       VLOG(2) << "one processed value "
-                 << " min_ " << min_ << " max_ " << max_;
-      // exactly one centroid, should have max_==min_
-      auto width = max_ - min_;
-      if (x < min_) {
+                 << " min " << min << " max " << max;
+      // exactly one centroid, should have max==min
+      auto width = max - min;
+      if (x < min) {
         return 0.0;
-      } else if (x > max_) {
+      } else if (x > max) {
         return 1.0;
-      } else if (x - min_ <= width) {
-        // min_ and max_ are too close together to do any viable interpolation
+      } else if (x - min <= width) {
+        // min and max are too close together to do any viable interpolation
         return 0.5;
       } else {
-        // interpolate if somehow we have weight > 0 and max_ != min_
-        return (x - min_) / (max_ - min_);
+        // interpolate if somehow we have weight > 0 and max != min
+        return (x - min) / (max - min);
       }
     } else {
-      auto n = processed_.size();
-      if (x <= min_) {
-        VLOG(2) << "below min_ "
-                   << " min_ " << min_ << " x " << x;
+      if (x <= min) {
+        VLOG(2) << "below min "
+                   << " min " << min << " x " << x;
         return 0;
       }
 
-      if (x >= max_) {
-        VLOG(2) << "above max_ "
-                   << " max_ " << max_ << " x " << x;
+      if (x >= max) {
+        VLOG(2) << "above max "
+                   << " max " << max << " x " << x;
         return 1;
       }
 
       // check for the left tail
-      if (x <= mean(0)) {
+      if (x <= centroids[0].mean()) {
         VLOG(2) << "left tail "
-                   << " min_ " << min_ << " mean(0) " << mean(0) << " x " << x;
+                   << " min " << min << " mean(0) " << centroids[0].mean() << " x " << x;
 
-        // note that this is different than mean(0) > min_ ... this guarantees interpolation works
-        if (mean(0) - min_ > 0) {
-          return (x - min_) / (mean(0) - min_) * weight(0) / processedWeight_ / 2.0;
+        // note that this is different than mean(0) > min ... this guarantees interpolation works
+        if (centroids[0].mean() - min > 0) {
+          return (x - min) / (centroids[0].mean() - min) * centroids[0].weight() / total / 2.0;
         } else {
           return 0;
         }
       }
 
       // and the right tail
-      if (x >= mean(n - 1)) {
+      if (x >= centroids[n - 1].mean()) {
         VLOG(2) << "right tail"
-                   << " max_ " << max_ << " mean(n - 1) " << mean(n - 1) << " x " << x;
+                   << " max " << max << " mean(n - 1) " << centroids[n - 1].mean() << " x " << x;
 
-        if (max_ - mean(n - 1) > 0) {
-          return 1.0 - (max_ - x) / (max_ - mean(n - 1)) * weight(n - 1) / processedWeight_ / 2.0;
+        if (max - centroids[n - 1].mean() > 0) {
+          return 1.0 - (max - x) / (max - centroids[n - 1].mean()) * centroids[n - 1].weight() / total / 2.0;
         } else {
           return 1;
         }
       }
 
-      CentroidComparator cc;
-      auto iter = std::upper_bound(processed_.cbegin(), processed_.cend(), Centroid(x, 0), cc);
-
-      auto i = std::distance(processed_.cbegin(), iter);
-      auto z1 = x - (iter - 1)->mean();
-      auto z2 = (iter)->mean() - x;
+      auto z1 = x - centroids[i - 1].mean();
+      auto z2 = centroids[i].mean() - x;
       CHECK_LE(0.0, z1);
       CHECK_LE(0.0, z2);
       VLOG(2) << "middle "
                  << " z1 " << z1 << " z2 " << z2 << " x " << x;
 
-      return weightedAverage(cumulative_[i - 1], z2, cumulative_[i], z1) / processedWeight_;
+      return weightedAverage(cumulative[i - 1], z2, cumulative[i], z1) / total;
     }
   }
 
-  // this returns a quantile on the t-digest
-  Value quantile(Value q) {
-    if (haveUnprocessed() || isDirty()) process();
-    return quantileProcessed(q);
+  // return the q-th quantile of the n sorted centroids starting at centroids, whose running half weights are in
+  // cumulative (n + 1 entries, as built by updateCumulative)
+  static Value quantileOf(const Centroid* centroids, const Weight* cumulative, Index n, Weight total, Value min,
+                          Value max, Value q) {
+    Index i = 0;
+    if (n > 1) i = std::distance(cumulative, std::lower_bound(cumulative, cumulative + n + 1, q * total));
+    return quantileAt(centroids, cumulative, n, total, min, max, q, i);
   }
 
-  // this returns a quantile on the currently processed values without changing the t-digest
-  // the value will not represent the unprocessed values
-  Value quantileProcessed(Value q) const {
+  // same as quantileOf, given the index i of the first cumulative weight at or above q * total
+  static Value quantileAt(const Centroid* centroids, const Weight* cumulative, Index n, Weight total, Value min,
+                          Value max, Value q, Index i) {
     if (q < 0 || q > 1) {
       LOG(ERROR) << "q should be in [0,1], got " << q;
       return NAN;
     }
 
-    if (processed_.size() == 0) {
+    if (n == 0) {
       // no sorted means no data, no way to get a quantile
       return NAN;
-    } else if (processed_.size() == 1) {
+    } else if (n == 1) {
       // with one data point, all quantiles lead to Rome
 
-      return mean(0);
+      return centroids[0].mean();
     }
 
     // we know that there are at least two sorted now
-    auto n = processed_.size();
 
     // if values were stored in a sorted array, index would be the offset we are Weighterested in
-    const auto index = q * processedWeight_;
+    const auto index = q * total;
 
-    // at the boundaries, we return min_ or max_
-    if (index < weight(0) / 2.0) {
-      CHECK_GT(weight(0), 0);
-      return min_ + 2.0 * index / weight(0) * (mean(0) - min_);
+    // at the boundaries, we return min or max
+    if (index <= centroids[0].weight() / 2.0) {
+      CHECK_GT(centroids[0].weight(), 0);
+      return min + 2.0 * index / centroids[0].weight() * (centroids[0].mean() - min);
     }
 
-    auto iter = std::lower_bound(cumulative_.cbegin(), cumulative_.cend(), index);
-
-    if (iter + 1 != cumulative_.cend()) {
-      auto i = std::distance(cumulative_.cbegin(), iter);
-      auto z1 = index - *(iter - 1);
-      auto z2 = *(iter)-index;
+    if (i < n) {
+      auto z1 = index - cumulative[i - 1];
+      auto z2 = cumulative[i] - index;
       VLOG(2) << "z2 " << z2 << " index " << index << " z1 " << z1;
-      return weightedAverage(mean(i - 1), z2, mean(i), z1);
+      return weightedAverage(centroids[i - 1].mean(), z2, centroids[i].mean(), z1);
     }
 
-    CHECK_LE(index, processedWeight_);
-    CHECK_GE(index, processedWeight_ - weight(n - 1) / 2.0);
+    CHECK_LE(index, total);
+    CHECK_GE(index, total - centroids[n - 1].weight() / 2.0);
 
-    auto z1 = index - processedWeight_ - weight(n - 1) / 2.0;
-    auto z2 = weight(n - 1) / 2 - z1;
-    return weightedAverage(mean(n - 1), z1, max_, z2);
+    auto z1 = index - (total - centroids[n - 1].weight() / 2.0);
+    auto z2 = total - index;
+    return weightedAverage(centroids[n - 1].mean(), z2, max, z1);
   }
 
-  Value compression() const { return compression_; }
-
-  void add(Value x) { add(x, 1); }
+  // exact count, sum, variance and extremes of every sample added or merged in
+  Moments moments() const {
+    const Moments scaled = (weightScale_ == 1) ? moments_ : moments_.scaled(weightScale_);
+    return transformed() ? scaled.transformed(valueScale_, valueOffset_) : scaled;
+  }
 
-  inline void compress() { process(); }
+  // empty the digest, keeping its compression, buffer sizes and dense domain
+  void reset() {
+    processed_.clear();
+    unprocessed_.clear();
+    cumulative_.clear();
+    processedWeight_ = 0;
+    unprocessedWeight_ = 0;
+    min_ = std::numeric_limits<Value>::max();
+    max_ = std::numeric_limits<Value>::lowest();
+    std::fill(denseCounts_.begin(), denseCounts_.end(), 0);
+    densePending_ = false;
+    moments_ = Moments();
+    lowTail_.clear();
+    highTail_.clear();
+    lowSorted_.clear();
+    highSorted_.clear();
+    weightScale_ = 1;
+    // watchers keep their thresholds in the units the values are reported in
+    for (auto& watcher : watchers_) watcher.threshold = toValue(watcher.threshold);
+    valueScale_ = 1;
+    valueOffset_ = 0;
+    for (auto& watcher : watchers_) watcher.threshold = toStored(watcher.threshold);
+    generation_++;
+    updateCumulative();
+  }
 
-  // add a single centroid to the unprocessed vector, processing previously unprocessed sorted if our limit has
-  // been reached.
-  inline bool add(Value x, Weight w) {
-    if (std::isnan(x)) {
-      return false;
-    }
-    unprocessed_.push_back(Centroid(x, w));
-    unprocessedWeight_ += w;
-    processIfNecessary();
-    return true;
+  // register a watcher on the weight above threshold and return its id.  samples added afterwards are counted
+  // exactly as they arrive; whatever has been compressed into centroids is estimated from the processed cdf each
+  // time the centroids change.  reading a watcher is O(1) and never processes the digest.
+  Index watch(Value threshold) {
+    watchers_.push_back(Watcher{toStored(threshold), 0, 0});
+    updateWatchers();
+    return watchers_.size() - 1;
   }
 
-  inline void add(std::vector<Centroid>::const_iterator iter, std::vector<Centroid>::const_iterator end) {
-    while (iter != end) {
-      const size_t diff = std::distance(iter, end);
-      const size_t room = maxUnprocessed_ - unprocessed_.size();
-      auto mid = iter + std::min(diff, room);
-      while (iter != mid) unprocessed_.push_back(*(iter++));
-      if (unprocessed_.size() >= maxUnprocessed_) {
-        process();
-      }
-    }
+  Weight weightAbove(Index watcher) const {
+    return (watchers_[watcher].processedAbove + watchers_[watcher].pendingAbove) * weightScale_;
   }
 
- private:
-  Value compression_;
+  Value fractionAbove(Index watcher) const {
+    const Weight total = (processedWeight_ + unprocessedWeight_) * weightScale_;
+    return (total > 0) ? weightAbove(watcher) / total : 0.0;
+  }
 
-  Value min_ = std::numeric_limits<Value>::max();
+  // keep the tailSize smallest and largest samples exactly, next to the centroids.  quantiles and cdf values that
+  // fall among them are answered exactly (with the same interpolation between unit samples that quantileProcessed
+  // uses for unit centroids) instead of from the centroids.  weights are taken as sample counts, so the exact
+  // tails assume integer weights.  must be called on an empty digest.
+  void setTailSize(Index tailSize) {
+    CHECK_EQ(totalWeight(), 0);
+    tailSize_ = tailSize;
+    lowTail_.reserve(tailSize);
+    highTail_.reserve(tailSize);
+  }
 
-  Value max_ = std::numeric_limits<Value>::min();
+  Index tailSize() const { return tailSize_; }
 
-  Index maxProcessed_;
+  // a stable 64 bit hash of the processed centroids, extremes, moments and exact tails, kept up to date by
+  // process() at no extra pass.  equal digests have equal fingerprints; unprocessed samples are not covered.
+  uint64_t fingerprint() const {
+    if (weightScale_ == 1 && !mapped()) return fingerprint_;
+    const uint64_t h = fingerprintMix(fingerprintMix(fingerprint_, weightScale_), logUnit_);
+    return fingerprintMix(fingerprintMix(h, valueScale_), valueOffset_);
+  }
 
-  Index maxUnprocessed_;
+  // a counter bumped by every add, merge, process and reset, so a reader that remembers it can tell cheaply whether
+  // the digest may have changed since
+  uint64_t generation() const { return generation_; }
+
+  // count integer samples in [low, high] directly in a flat array instead of buffering centroids.  while dense,
+  // processed_ holds one exact centroid per distinct value.  the digest goes back to ordinary centroids (and is
+  // compressed) as soon as a sample outside the domain arrives or a digest that is not dense over the same domain
+  // is merged in.  must be called on an empty digest.
+  void setDenseDomain(int64_t low, int64_t high) {
+    CHECK_EQ(totalWeight(), 0);
+    CHECK_EQ(logUnit_, 0);
+    CHECK(!strictBound_);
+    CHECK_LE(low, high);
+    denseLow_ = static_cast<Value>(low);
+    denseCounts_.assign(static_cast<Index>(high - low + 1), 0);
+  }
 
-  Value processedWeight_ = 0.0;
+  bool dense() const { return !denseCounts_.empty(); }
+
+  Value denseLow() const { return denseLow_; }
+
+  // weights counted in dense mode since the last process(), indexed by value - denseLow()
+  const std::vector<Weight>& denseCounts() const { return denseCounts_; }
+
+  // add centroids that are already sorted by mean.  they are merged straight into the processed centroids without
+  // going through the sort in process(), and compressed only once processed_ outgrows maxProcessed_.
+  void addSorted(const Centroid* begin, const Centroid* end) {
+    if (begin == end) return;
+    if (dense()) leaveDense();
+    auto count = processed_.size();
+    processed_.insert(processed_.end(), begin, end);
+    if (weightScale_ != 1) dropTails();
+    for (auto iter = processed_.begin() + count; iter != processed_.end(); iter++) {
+      if (weightScale_ != 1 || mapped()) *iter = Centroid(toStored(iter->mean()), iter->weight() / weightScale_);
+      processedWeight_ += iter->weight();
+      observe(iter->mean(), iter->weight());
+    }
+    std::inplace_merge(processed_.begin(), processed_.begin() + count, processed_.end(), CentroidComparator());
+    min_ = std::min(min_, processed_[0].mean());
+    max_ = std::max(max_, (processed_.cend() - 1)->mean());
+    if (isDirty()) {
+      process();
+    } else {
+      updateCumulative();
+    }
+  }
 
-  Value unprocessedWeight_ = 0.0;
+  // import a histogram exported as (value, count) pairs sorted by value, such as the recorded values of an
+  // HdrHistogram snapshot.  each pair becomes one centroid.
+  void addHistogram(const Value* values, const Weight* counts, Index n) {
+    imported_.clear();
+    for (Index i = 0; i < n; i++) {
+      if (counts[i] > 0) imported_.emplace_back(values[i], counts[i]);
+    }
+    addSorted(imported_.data(), imported_.data() + imported_.size());
+  }
 
-  std::vector<Centroid> processed_;
+  // import Prometheus style cumulative buckets: counts[i] samples were at most upperBounds[i], with the bounds
+  // ascending and the last one possibly +Inf.  each bucket becomes a centroid at its midpoint; the first bucket
+  // starts at lowerBound and the +Inf bucket sits on the largest finite bound.
+  void addCumulativeBuckets(const Value* upperBounds, const Weight* cumulativeCounts, Index n, Value lowerBound) {
+    imported_.clear();
+    Value lower = lowerBound;
+    Weight previous = 0;
+    for (Index i = 0; i < n; i++) {
+      const Value upper = std::isinf(upperBounds[i]) ? lower : upperBounds[i];
+      const Weight count = cumulativeCounts[i] - previous;
+      if (count > 0) imported_.emplace_back(lower + (upper - lower) / 2, count);
+      lower = upper;
+      previous = cumulativeCounts[i];
+    }
+    addSorted(imported_.data(), imported_.data() + imported_.size());
+  }
 
-  std::vector<Centroid> unprocessed_;
+  // import one side of an OpenTelemetry exponential histogram.  bucket offset + i covers (base^(offset + i),
+  // base^(offset + i + 1)] with base = 2^(2^-scale), or the mirror image of that for the negative buckets.  each
+  // bucket becomes a centroid at its midpoint.  the zero bucket is an ordinary add(0, zeroCount).
+  void addExponentialBuckets(int scale, int32_t offset, const Weight* counts, Index n, bool negative = false) {
+    imported_.clear();
+    const Value base = std::exp2(std::exp2(-scale));
+    Value lower = std::pow(base, offset);
+    for (Index i = 0; i < n; i++) {
+      const Value upper = lower * base;
+      if (counts[i] > 0) imported_.emplace_back(lower + (upper - lower) / 2, counts[i]);
+      lower = upper;
+    }
+    if (negative) {
+      std::reverse(imported_.begin(), imported_.end());
+      for (auto& centroid : imported_) centroid = Centroid(-centroid.mean(), centroid.weight());
+    }
+    addSorted(imported_.data(), imported_.data() + imported_.size());
+  }
 
-  std::vector<Weight> cumulative_;
+  // fill cumulativeCounts[j] with the weight at or below upperBounds[j], Prometheus style, for n ascending bounds.
+  // the counts agree with cdf(upperBounds[j]) * totalWeight() but take a single walk over the centroids.
+  void cumulativeBuckets(const Value* upperBounds, Index n, Weight* cumulativeCounts) {
+    if (haveUnprocessed() || isDirty()) process();
+    Index i = 0;
+    for (Index j = 0; j < n; j++) {
+      cumulativeCounts[j] = weightAtOrBelow(upperBounds[j], &i);
+    }
+  }
 
-  // return mean of i-th centroid
-  inline Value mean(int i) const noexcept { return processed_[i].mean(); }
+  // fill counts[j] with the weight in bucket offset + j of an OpenTelemetry exponential histogram, that is in
+  // (base^(offset + j), base^(offset + j + 1)] with base = 2^(2^-scale), or the mirror image of that for the
+  // negative buckets.  the bucket bounds are visited in ascending order in a single walk over the centroids.
+  void exponentialBuckets(int scale, int32_t offset, Index n, Weight* counts, bool negative = false) {
+    if (haveUnprocessed() || isDirty()) process();
+    const Value step = std::exp2(-scale);
+    Index i = 0;
+    if (negative) {
+      Weight previous = weightAtOrBelow(-std::exp2((offset + static_cast<Value>(n)) * step), &i);
+      for (Index j = n; j-- > 0;) {
+        const Weight current = weightAtOrBelow(-std::exp2((offset + static_cast<Value>(j)) * step), &i);
+        counts[j] = current - previous;
+        previous = current;
+      }
+    } else {
+      Weight previous = weightAtOrBelow(std::exp2(offset * step), &i);
+      for (Index j = 0; j < n; j++) {
+        const Weight current = weightAtOrBelow(std::exp2((offset + static_cast<Value>(j) + 1) * step), &i);
+        counts[j] = current - previous;
+        previous = current;
+      }
+    }
+  }
 
-  // return weight of i-th centroid
-  inline Weight weight(int i) const noexcept { return processed_[i].weight(); }
+  // weight of the samples in (xLow, xHigh], consistent with the difference of cdf() at the two ends
+  Value countBetween(Value low, Value high) {
+    if (haveUnprocessed() || isDirty()) process();
+    const Value xLow = toStored(low);
+    const Value xHigh = toStored(high);
+    Weight count = 0;
+    forEachSegment([&](Value x0, Value x1, Weight c0, Weight c1) {
+      if (x0 > xHigh) return false;
+      count += overlap(x0, x1, xLow, xHigh) * (c1 - c0);
+      return true;
+    });
+    return count * weightScale_;
+  }
 
-  // append all unprocessed centroids into current unprocessed vector
-  void mergeUnprocessed(const std::vector<const TDigest*>& tdigests) {
-    if (tdigests.size() == 0) return;
+  // sum of the samples in (xLow, xHigh], taking the weight between neighbouring centroids to be spread evenly
+  // between their means, as cdf() does
+  Value sumBetween(Value low, Value high) {
+    if (haveUnprocessed() || isDirty()) process();
+    const Value xLow = toStored(low);
+    const Value xHigh = toStored(high);
+    Value sum = 0;
+    forEachSegment([&](Value x0, Value x1, Weight c0, Weight c1) {
+      if (x0 > xHigh) return false;
+      const Value fraction = overlap(x0, x1, xLow, xHigh);
+      if (fraction > 0) {
+        const Value lo = (x1 > x0) ? std::max(x0, xLow) : x0;
+        const Value hi = (x1 > x0) ? std::min(x1, xHigh) : x1;
+        sum += fraction * (c1 - c0) * meanValue(lo, hi);
+      }
+      return true;
+    });
+    return sum * weightScale_;
+  }
 
-    size_t total = unprocessed_.size();
-    for (auto& td : tdigests) {
-      total += td->unprocessed_.size();
+  // mean of the samples between the qLow and qHigh quantiles, integrating the same piecewise linear inverse cdf
+  // that quantile() interpolates
+  Value trimmedMean(Value qLow, Value qHigh) {
+    if (haveUnprocessed() || isDirty()) process();
+    if (qLow < 0 || qHigh > 1 || qLow > qHigh || processed_.size() == 0) {
+      return NAN;
     }
+    const Weight rLow = qLow * processedWeight_;
+    const Weight rHigh = qHigh * processedWeight_;
+    if (rHigh == rLow) return quantileProcessed(qLow);
+    Value sum = 0;
+    forEachSegment([&](Value x0, Value x1, Weight c0, Weight c1) {
+      if (c0 >= rHigh) return false;
+      const Weight lo = std::max(c0, rLow);
+      const Weight hi = std::min(c1, rHigh);
+      if (hi > lo) {
+        const Value slope = (x1 - x0) / (c1 - c0);
+        sum += (hi - lo) * meanValue(x0 + (lo - c0) * slope, x0 + (hi - c0) * slope);
+      }
+      return true;
+    });
+    return sum / (rHigh - rLow);
+  }
 
-    unprocessed_.reserve(total);
-    for (auto& td : tdigests) {
-      unprocessed_.insert(unprocessed_.end(), td->unprocessed_.cbegin(), td->unprocessed_.cend());
-      unprocessedWeight_ += td->unprocessedWeight_;
-    }
+  // Kolmogorov-Smirnov distance, sup |Fa(x) - Fb(x)|, between the piecewise linear cdfs of two processed digests
+  static Value ksDistance(const TDigest& a, const TDigest& b) {
+    Value distance = 0;
+    compareCdfs(a, b, [&](Value, Value fa0, Value fb0, Value fa1, Value fb1) {
+      distance = std::max(distance, std::max(std::abs(fa0 - fb0), std::abs(fa1 - fb1)));
+    });
+    return distance;
   }
 
-  // merge all processed centroids together into a single sorted vector
-  void mergeProcessed(const std::vector<const TDigest*>& tdigests) {
-    if (tdigests.size() == 0) return;
+  // first Wasserstein (earth mover's) distance, the integral of |Fa(x) - Fb(x)|, between two processed digests
+  static Value wasserstein1(const TDigest& a, const TDigest& b) {
+    Value distance = 0;
+    compareCdfs(a, b, [&](Value width, Value fa0, Value fb0, Value fa1, Value fb1) {
+      const Value d0 = fa0 - fb0;
+      const Value d1 = fa1 - fb1;
+      if ((d0 < 0) == (d1 < 0) || d0 == 0 || d1 == 0) {
+        distance += width * std::abs(d0 + d1) / 2;
+      } else {
+        // the difference changes sign inside the piece, so integrate the two triangles
+        distance += width * (d0 * d0 + d1 * d1) / (std::abs(d0) + std::abs(d1)) / 2;
+      }
+    });
+    return distance;
+  }
 
-    size_t total = 0;
-    CentroidListQueue pq(CentroidListComparator{});
-    for (auto& td : tdigests) {
+  // P[X < Y] for X drawn from a and Y from b, with ties counted half, on the cdfs of two processed digests
+  static Value probabilityLess(const TDigest& a, const TDigest& b) {
+    Value probability = 0;
+    compareCdfs(a, b, [&](Value, Value fa0, Value fb0, Value fa1, Value fb1) {
+      probability += (fb1 - fb0) * (fa0 + fa1) / 2;
+    });
+    return probability;
+  }
+
+  // answers cdf and quantile queries on a processed digest, searching forward from the previous answer rather than
+  // from scratch.  a sweep of m increasing queries costs O(n + m) instead of O(m log n); a query below the previous
+  // one restarts the search.  the digest must not change while the cursor is in use.
+  class Cursor {
+   public:
+    explicit Cursor(const TDigest& digest) : digest_(digest) {}
+
+    Value cdf(Value value) {
+      const Value x = digest_.toStored(value);
+      Value c;
+      if (digest_.tailCdf(x, &c)) return c;
+      const auto& processed = digest_.processed_;
+      const Index n = processed.size();
+      if (!(x >= lastX_)) centroid_ = 0;
+      lastX_ = x;
+      centroid_ = gallop(centroid_, n, [&](Index i) { return processed[i].mean() > x; });
+      return cdfAt(processed.data(), digest_.cumulative_.data(), n, digest_.processedWeight_, digest_.min_,
+                   digest_.max_, x, centroid_);
+    }
+
+    Value quantile(Value q) {
+      Value x;
+      if (digest_.tailQuantile(q, &x)) return digest_.toValue(x);
+      const auto& cumulative = digest_.cumulative_;
+      const Index n = digest_.processed_.size();
+      if (!(q >= lastQ_)) cumulative_ = 0;
+      lastQ_ = q;
+      if (n > 1) {
+        const Weight index = q * digest_.processedWeight_;
+        cumulative_ = gallop(cumulative_, n, [&](Index i) { return cumulative[i] >= index; });
+      }
+      return digest_.toValue(quantileAt(digest_.processed_.data(), cumulative.data(), n, digest_.processedWeight_,
+                                        digest_.min_, digest_.max_, q, cumulative_));
+    }
+
+   private:
+    const TDigest& digest_;
+    Value lastX_ = -INFINITY;
+    Value lastQ_ = 0;
+    Index centroid_ = 0;
+    Index cumulative_ = 0;
+  };
+
+  // a cursor over the digest, processing it first if needed
+  Cursor cursor() {
+    if (haveUnprocessed() || isDirty()) process();
+    return Cursor(*this);
+  }
+
+  // draws samples from a processed digest by inverting the piecewise linear quantile function that
+  // quantileProcessed interpolates, exact tails included.  the knots of that function are copied once, and a
+  // uniform grid over [0, 1] gives each draw the knot its short forward search starts from.  later changes to the
+  // digest are not seen.
+  class Sampler {
+   public:
+    explicit Sampler(const TDigest& digest) {
+      const auto& processed = digest.processed_;
+      const Index n = processed.size();
+      const Weight total = digest.processedWeight_;
+      if (n == 0 || total <= 0) return;
+
+      const auto& low = digest.lowSorted_;
+      const auto& high = digest.highSorted_;
+      Weight lo = 0;
+      Weight hi = total;
+      if (!low.empty()) {
+        // unit samples centered on their ranks, flat below the first and above the last, as in tailQuantile
+        addKnot(0, low[0]);
+        for (Index j = 0; j < low.size(); j++) addKnot(j + 0.5, low[j]);
+        lo = low.size() - 0.5;
+        hi = total - (high.size() - 0.5);
+      }
+      if (lo < hi) {
+        const Weight* cumulative = digest.cumulative_.data();
+        auto at = [&](Weight index) {
+          return quantileOf(processed.data(), cumulative, n, total, digest.min_, digest.max_, index / total);
+        };
+        addKnot(lo, at(lo));
+        for (Index i = 0; n > 1 && i < n; i++) {
+          if (cumulative[i] > lo && cumulative[i] < hi) addKnot(cumulative[i], at(cumulative[i]));
+        }
+        addKnot(hi, at(hi));
+      }
+      if (!high.empty()) {
+        for (Index j = high.size(); j-- > 0;) {
+          if (total - (j + 0.5) >= lo) addKnot(total - (j + 0.5), high[j]);
+        }
+        addKnot(total, high[0]);
+      }
+
+      for (auto& q : q_) q /= total;
+      logUnit_ = digest.logUnit_;
+      valueScale_ = digest.valueScale_;
+      valueOffset_ = digest.valueOffset_;
+      q_.back() = 1;
+      for (Index k = 0; k + 1 < q_.size(); k++) {
+        const Weight width = q_[k + 1] - q_[k];
+        slope_.push_back(width > 0 ? (x_[k + 1] - x_[k]) / width : 0);
+      }
+      grid_.resize(2 * q_.size());
+      Index k = 0;
+      for (Index g = 0; g < grid_.size(); g++) {
+        const Weight u = static_cast<Weight>(g) / grid_.size();
+        while (k + 2 < q_.size() && q_[k + 1] <= u) k++;
+        grid_[g] = k;
+      }
+    }
+
+    // the value at quantile u in [0, 1]
+    Value at(Weight u) const {
+      if (q_.empty()) return NAN;
+      Index k = grid_[std::min<Index>(u * grid_.size(), grid_.size() - 1)];
+      while (k + 2 < q_.size() && q_[k + 1] <= u) k++;
+      const Value x = x_[k] + (u - q_[k]) * slope_[k];
+      return valueScale_ * ((logUnit_ > 0) ? logDecode(x, logUnit_) : x) + valueOffset_;
+    }
+
+    template <typename Generator>
+    Value sample(Generator& gen) const {
+      std::uniform_real_distribution<Weight> uniform(0, 1);
+      return at(uniform(gen));
+    }
+
+    template <typename Generator>
+    void sample(Value* out, Index count, Generator& gen) const {
+      std::uniform_real_distribution<Weight> uniform(0, 1);
+      for (Index i = 0; i < count; i++) out[i] = at(uniform(gen));
+    }
+
+   private:
+    void addKnot(Weight index, Value x) {
+      q_.push_back(index);
+      x_.push_back(x);
+    }
+
+    std::vector<Weight> q_;
+    std::vector<Value> x_;
+    std::vector<Value> slope_;
+    std::vector<Index> grid_;
+    // the digest's map from stored to reported values
+    Value logUnit_ = 0;
+    Value valueScale_ = 1;
+    Value valueOffset_ = 0;
+  };
+
+  // fill out with the k - 1 equi-depth boundaries quantile(j / k), j = 1 .. k - 1, in a single walk over the
+  // cumulative weights
+  void splitPoints(Index k, Value* out) {
+    if (haveUnprocessed() || isDirty()) process();
+    const auto n = processed_.size();
+    Index i = 0;
+    for (Index j = 1; j < k; j++) {
+      const Value q = static_cast<Value>(j) / k;
+      Value x;
+      if (!tailQuantile(q, &x)) {
+        if (n > 1) {
+          while (i <= n && cumulative_[i] < q * processedWeight_) i++;
+        }
+        x = quantileAt(processed_.data(), cumulative_.data(), n, processedWeight_, min_, max_, q, i);
+      }
+      out[j - 1] = toValue(x);
+    }
+  }
+
+  // fill out with the k - 1 equi-depth boundaries of the union of several processed digests, without merging them.
+  // each digest counts with its processed weight, scaled by weights[d] when weights is not null.  the boundaries
+  // come from one walk over the merged knots of the digests' piecewise linear cdfs, cut at the ranks of any exact
+  // tails so that a single digest gets the boundaries of its own splitPoints.
+  static void splitPoints(const std::vector<const TDigest*>& digests, const Weight* weights, Index k, Value* out) {
+    std::vector<Knots> knots;
+    std::vector<Weight> mass;
+    Weight total = 0;
+    for (Index d = 0; d < digests.size(); d++) {
+      if (digests[d]->processed_.size() == 0) continue;
+      knots.emplace_back(*digests[d], true);
+      mass.push_back(digests[d]->processedWeight() * (weights != nullptr ? weights[d] : 1));
+      total += mass.back();
+    }
+
+    Index j = 1;
+    Value x0 = NAN;
+    Weight g0 = 0;
+    while (j < k && total > 0) {
+      Value x = INFINITY;
+      for (auto& walker : knots) {
+        if (!walker.done()) x = std::min(x, walker.xAt(walker.i));
+      }
+      if (x == INFINITY) break;
+
+      // the mixture cdf is linear up to x, then jumps by any point masses at x
+      Weight before = 0;
+      Weight after = 0;
+      for (Index d = 0; d < knots.size(); d++) {
+        const Value b = knots[d].before(x);
+        before += mass[d] * b;
+        after += mass[d] * knots[d].after(x, b);
+      }
+      for (; j < k && j * total / k <= before; j++) {
+        out[j - 1] = x0 + (j * total / k - g0) / (before - g0) * (x - x0);
+      }
+      for (; j < k && j * total / k <= after; j++) {
+        out[j - 1] = x;
+      }
+      x0 = x;
+      g0 = after;
+    }
+    for (; j < k; j++) out[j - 1] = x0;
+  }
+
+ private:
+  Value compression_;
+
+  Value min_ = std::numeric_limits<Value>::max();
+
+  Value max_ = std::numeric_limits<Value>::lowest();
+
+  Index maxProcessed_;
+
+  Index maxUnprocessed_;
+
+  Value processedWeight_ = 0.0;
+
+  Value unprocessedWeight_ = 0.0;
+
+  std::vector<Centroid> processed_;
+
+  std::vector<Centroid> unprocessed_;
+
+  std::vector<Weight> cumulative_;
+
+  // fingerprint of the processed state, refreshed with the cumulative weights
+  uint64_t fingerprint_ = 0;
+
+  uint64_t generation_ = 0;
+
+  // multiplier from the stored weights to the weights the digest reports, see scaleWeights()
+  Weight weightScale_ = 1;
+
+  // the increasing affine map from stored means to reported values, see transformValues()
+  Value valueScale_ = 1;
+
+  Value valueOffset_ = 0;
+
+  // unit of the log domain the means are stored in, 0 when they are stored as they are, see setLogDomain()
+  Value logUnit_ = 0;
+
+  Moments moments_;
+
+  struct Watcher {
+    Value threshold;
+    Weight processedAbove;
+    Weight pendingAbove;
+  };
+
+  std::vector<Watcher> watchers_;
+
+  // the tailSize_ smallest samples as a max-heap and the largest as a min-heap, plus sorted copies of both (the
+  // largest first) refreshed with the cumulative weights
+  Index tailSize_ = 0;
+
+  std::vector<Value> lowTail_;
+
+  std::vector<Value> highTail_;
+
+  std::vector<Value> lowSorted_;
+
+  std::vector<Value> highSorted_;
+
+  // lowest value of the dense domain and the counts per value since the last process(), empty unless dense
+  Value denseLow_ = 0;
+
+  bool densePending_ = false;
+
+  std::vector<Weight> denseCounts_;
+
+  // scratch prefix weights used by process()
+  std::vector<Weight> prefix_;
+
+  // whether processed_ is held to maxProcessed_ at all times, and the scratch centroids used to keep it there
+  bool strictBound_ = false;
+
+  std::vector<Centroid> boundScratch_;
+
+  // scratch centroids built by the histogram importers
+  std::vector<Centroid> imported_;
+
+  // scratch buffers used to sort unprocessed_
+  std::vector<CentroidKey> sortKeys_;
+
+  std::vector<CentroidKey> sortScratch_;
+
+  // the processed cdf at a stored value
+  Value cdfStored(Value x) const {
+    Value c;
+    if (tailCdf(x, &c)) return c;
+    return cdfOf(processed_.data(), cumulative_.data(), processed_.size(), processedWeight_, min_, max_, x);
+  }
+
+  // processed weight at or below x, for x no smaller than on the previous call with the same position *i
+  inline Weight weightAtOrBelow(Value value, Index* i) const {
+    const Value x = toStored(value);
+    while (*i < processed_.size() && processed_[*i].mean() <= x) (*i)++;
+    Value c;
+    if (tailCdf(x, &c)) return processedWeight_ * weightScale_ * c;
+    return processedWeight_ * weightScale_ *
+           cdfAt(processed_.data(), cumulative_.data(), processed_.size(), processedWeight_, min_, max_, x, *i);
+  }
+
+  // account a sample in everything that is kept exactly next to the centroids
+  inline void observe(Value x, Weight w) {
+    generation_++;
+    moments_.add(decode(x), w);
+    trackTails(x, w);
+    for (auto& watcher : watchers_) {
+      watcher.pendingAbove += (x > watcher.threshold) ? w : 0;
+    }
+  }
+
+  // rebase the watchers on the processed centroids and recount what is still pending exactly
+  void updateWatchers() {
+    for (auto& watcher : watchers_) {
+      watcher.processedAbove = (1 - cdfStored(watcher.threshold)) * processedWeight_;
+      watcher.pendingAbove = 0;
+      for (auto& centroid : unprocessed_) {
+        watcher.pendingAbove += (centroid.mean() > watcher.threshold) ? centroid.weight() : 0;
+      }
+      for (Index i = 0; i < denseCounts_.size(); i++) {
+        watcher.pendingAbove += (denseLow_ + i > watcher.threshold) ? denseCounts_[i] : 0;
+      }
+    }
+  }
+
+  inline void trackTails(Value x, Weight w) {
+    if (tailSize_ == 0) return;
+    const Index copies = (w >= tailSize_) ? tailSize_ : static_cast<Index>(w);
+    for (Index i = 0; i < copies; i++) {
+      trackLowTail(x);
+      trackHighTail(x);
+    }
+  }
+
+  // forget the exact tails for good, once samples arrive whose weights are not the unit counts the tails assume
+  void dropTails() {
+    if (tailSize_ == 0) return;
+    tailSize_ = 0;
+    lowTail_.clear();
+    highTail_.clear();
+    lowSorted_.clear();
+    highSorted_.clear();
+  }
+
+  // a digest that kept at least as many tail samples hands over its own; otherwise its centroids stand in for the
+  // samples so that the tails still cover all of the weight
+  void mergeTails(const TDigest& td) {
+    if (tailSize_ == 0) return;
+    if (td.tailSize_ >= tailSize_) {
+      for (auto x : td.lowTail_) trackLowTail(mapFrom(td, x));
+      for (auto x : td.highTail_) trackHighTail(mapFrom(td, x));
+      return;
+    }
+    for (auto& centroid : td.processed_) trackTails(mapFrom(td, centroid.mean()), centroid.weight());
+    for (auto& centroid : td.unprocessed_) trackTails(mapFrom(td, centroid.mean()), centroid.weight());
+    for (Index i = 0; i < td.denseCounts_.size(); i++) {
+      trackTails(mapFrom(td, td.denseLow_ + i), td.denseCounts_[i]);
+    }
+  }
+
+  inline void trackLowTail(Value x) {
+    if (lowTail_.size() < tailSize_) {
+      lowTail_.push_back(x);
+      std::push_heap(lowTail_.begin(), lowTail_.end());
+    } else if (x < lowTail_.front()) {
+      std::pop_heap(lowTail_.begin(), lowTail_.end());
+      lowTail_.back() = x;
+      std::push_heap(lowTail_.begin(), lowTail_.end());
+    }
+  }
+
+  inline void trackHighTail(Value x) {
+    if (highTail_.size() < tailSize_) {
+      highTail_.push_back(x);
+      std::push_heap(highTail_.begin(), highTail_.end(), std::greater<Value>());
+    } else if (x > highTail_.front()) {
+      std::pop_heap(highTail_.begin(), highTail_.end(), std::greater<Value>());
+      highTail_.back() = x;
+      std::push_heap(highTail_.begin(), highTail_.end(), std::greater<Value>());
+    }
+  }
+
+  // the exact quantile if q falls among the tail samples.  samples are unit weights centered on their rank, as in
+  // quantileProcessed, so index counts from the smallest sample and fromTop from the largest.
+  bool tailQuantile(Value q, Value* x) const {
+    if (lowSorted_.empty() || processedWeight_ <= 0 || q < 0 || q > 1) return false;
+    const Weight index = q * processedWeight_;
+    const Index n = lowSorted_.size();
+    if (index < n - 0.5) {
+      *x = (index < 0.5) ? lowSorted_[0] : interpolateSorted(lowSorted_, index - 0.5);
+      return true;
+    }
+    const Weight fromTop = processedWeight_ - index;
+    if (fromTop < highSorted_.size() - 0.5) {
+      *x = (fromTop <= 0.5) ? highSorted_[0] : interpolateSorted(highSorted_, fromTop - 0.5);
+      return true;
+    }
+    return false;
+  }
+
+  // the exact cdf if x falls strictly between the extreme tail samples
+  bool tailCdf(Value x, Value* c) const {
+    if (lowSorted_.empty() || processedWeight_ <= 0) return false;
+    const Index n = lowSorted_.size();
+    if (x > lowSorted_[0] && x < lowSorted_[n - 1]) {
+      const Index i = std::distance(lowSorted_.cbegin(), std::upper_bound(lowSorted_.cbegin(), lowSorted_.cend(), x));
+      const Value fraction = (x - lowSorted_[i - 1]) / (lowSorted_[i] - lowSorted_[i - 1]);
+      *c = (i - 0.5 + fraction) / processedWeight_;
+      return true;
+    }
+    const Index m = highSorted_.size();
+    if (x < highSorted_[0] && x > highSorted_[m - 1]) {
+      const Index j = std::distance(highSorted_.cbegin(), std::lower_bound(highSorted_.cbegin(), highSorted_.cend(),
+                                                                           x, std::greater<Value>()));
+      const Value fraction = (highSorted_[j - 1] - x) / (highSorted_[j - 1] - highSorted_[j]);
+      *c = 1.0 - (j - 0.5 + fraction) / processedWeight_;
+      return true;
+    }
+    return false;
+  }
+
+  // the first index in [from, n) at which the monotone predicate holds, or n, by doubling steps from from and then
+  // bisecting the last step.  the cost is logarithmic in the distance moved rather than in n.
+  template <typename P>
+  static Index gallop(Index from, Index n, P above) {
+    Index lo = from;
+    Index hi = from;
+    Index step = 1;
+    while (hi < n && !above(hi)) {
+      lo = hi + 1;
+      hi = std::min(n, hi + step);
+      step *= 2;
+    }
+    while (lo < hi) {
+      const Index mid = lo + (hi - lo) / 2;
+      if (above(mid)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  // linear interpolation at a fractional position in a sorted vector
+  static Value interpolateSorted(const std::vector<Value>& sorted, Value position) {
+    const auto i = static_cast<Index>(position);
+    return sorted[i] + (position - i) * (sorted[i + 1] - sorted[i]);
+  }
+
+  // the knots of the piecewise linear cdf of a processed digest, normalized to [0, 1], with a position that only
+  // moves forward.  they are the ends of the pieces forEachSegment walks, so the exact tails are followed where
+  // they are kept.
+  struct Knots {
+    explicit Knots(const TDigest& digest, bool byRank = false) {
+      Value lastX = NAN;
+      Weight lastC = NAN;
+      digest.forEachSegment(
+          [&](Value x0, Value x1, Weight c0, Weight c1) {
+            if (x0 != lastX || c0 != lastC) add(digest, x0, c0);
+            add(digest, x1, c1);
+            lastX = x1;
+            lastC = c1;
+            return true;
+          },
+          byRank);
+      size = x.size();
+    }
+
+    std::vector<Value> x;
+    std::vector<Value> c;
+    Index size = 0;
+    Index i = 0;
+
+    void add(const TDigest& digest, Value stored, Weight rank) {
+      x.push_back(digest.toValue(stored));
+      c.push_back(rank / digest.processedWeight_);
+    }
+
+    Value xAt(Index k) const { return x[k]; }
+
+    Value cAt(Index k) const { return c[k]; }
+
+    bool done() const { return i == size; }
+
+    // the cdf approaching x from the left, given every knot below x has been passed
+    Value before(Value x) const {
+      if (i == 0) return 0;
+      if (i == size) return 1;
+      return cAt(i - 1) + (cAt(i) - cAt(i - 1)) * (x - xAt(i - 1)) / (xAt(i) - xAt(i - 1));
+    }
+
+    // pass the knots at x and return the cdf just after x, which is more than before(x) at a point mass
+    Value after(Value x, Value before) {
+      Value value = before;
+      while (i < size && xAt(i) == x) value = cAt(i++);
+      return value;
+    }
+  };
+
+  // walk the merged knots of two processed digests' cdfs, exact tails included.  between consecutive knots both cdfs
+  // are linear, and f(width, fa0, fb0, fa1, fb1) is called with the values at both ends of each such piece.  a point
+  // mass in either cdf is a piece of zero width.
+  template <typename F>
+  static void compareCdfs(const TDigest& a, const TDigest& b, F f) {
+    if (a.processed_.size() == 0 || b.processed_.size() == 0) return;
+    Knots ka(a);
+    Knots kb(b);
+    Value x0 = std::min(ka.xAt(0), kb.xAt(0));
+    Value fa0 = 0;
+    Value fb0 = 0;
+    while (!ka.done() || !kb.done()) {
+      const Value x = std::min(ka.done() ? INFINITY : ka.xAt(ka.i), kb.done() ? INFINITY : kb.xAt(kb.i));
+      const Value fa1 = ka.before(x);
+      const Value fb1 = kb.before(x);
+      f(x - x0, fa0, fb0, fa1, fb1);
+      fa0 = ka.after(x, fa1);
+      fb0 = kb.after(x, fb1);
+      f(0, fa1, fb1, fa0, fb0);
+      x0 = x;
+    }
+  }
+
+  // walk the pieces of the piecewise linear cdf: from (min_, 0) through (mean(i), cumulative_[i]) for every
+  // centroid to (max_, processedWeight_).  with exact tails, the values from the smallest to the largest of the low
+  // tail and likewise at the top are instead pieces between the tail samples, unit samples centered on their ranks
+  // as in tailCdf, and the centroid pieces only cover the values in between.  a jump between the two is a piece of
+  // zero width.  with byRank the centroid pieces are cut at the ranks of the tails instead, giving the inverse that
+  // quantile() interpolates with tailQuantile, which can step back in value at the joins.  f(x0, x1, c0, c1) gets
+  // each piece and returns false to stop.
+  template <typename F>
+  void forEachSegment(F f, bool byRank = false) const {
+    const auto n = processed_.size();
+    if (n == 0) return;
+    const Weight total = processedWeight_;
+    Value x0 = min_;
+    Weight c0 = 0;
+    bool more = true;
+    auto to = [&](Value x1, Weight c1) {
+      if (!more || c1 < c0) return;
+      if (c1 > c0) more = f(x0, x1, c0, c1);
+      x0 = x1;
+      c0 = c1;
+    };
+    if (lowSorted_.empty()) {
+      for (Index i = 0; i < n; i++) to(mean(i), cumulative_[i]);
+      to(max_, total);
+      return;
+    }
+    x0 = lowSorted_[0];
+    for (Index j = 0; j < lowSorted_.size(); j++) to(lowSorted_[j], j + 0.5);
+    const Weight bottom = lowSorted_.size() - 0.5;
+    const Weight top = total - (highSorted_.size() - 0.5);
+    const Value xLow = lowSorted_.back();
+    const Value xHigh = highSorted_.back();
+    if (byRank && bottom < top) {
+      // the stored value at rank r on the centroid pieces
+      auto at = [&](Weight r) {
+        const Index i = std::distance(cumulative_.cbegin(), std::upper_bound(cumulative_.cbegin(),
+                                                                             cumulative_.cbegin() + n, r));
+        const Value xa = (i == 0) ? min_ : mean(i - 1);
+        const Weight ca = (i == 0) ? 0 : cumulative_[i - 1];
+        const Value xb = (i == n) ? max_ : mean(i);
+        const Weight cb = (i == n) ? total : cumulative_[i];
+        return (cb > ca) ? xa + (r - ca) / (cb - ca) * (xb - xa) : xb;
+      };
+      to(at(bottom), bottom);
+      for (Index i = 0; i < n; i++) {
+        if (cumulative_[i] > bottom && cumulative_[i] < top) to(mean(i), cumulative_[i]);
+      }
+      to(at(top), top);
+    } else if (!byRank && xLow < xHigh) {
+      // the centroid pieces are cut off where tailCdf takes over, kept between the ranks of the tails
+      auto rank = [&](Value x) {
+        return total * cdfOf(processed_.data(), cumulative_.data(), n, total, min_, max_, x);
+      };
+      auto clamped = [&](Weight c) { return std::min(top, std::max(c0, c)); };
+      to(xLow, clamped(rank(xLow)));
+      for (Index i = 0; i < n; i++) {
+        if (mean(i) > xLow && mean(i) < xHigh) to(mean(i), clamped(cumulative_[i]));
+      }
+      to(xHigh, clamped(rank(xHigh)));
+    }
+    for (Index j = highSorted_.size(); j-- > 0;) to(highSorted_[j], total - (j + 0.5));
+    to(highSorted_[0], total);
+  }
+
+  // the fraction of the piece [x0, x1] that lies in (xLow, xHigh]; a piece of zero width is a point mass
+  static Value overlap(Value x0, Value x1, Value xLow, Value xHigh) {
+    if (x1 <= x0) return (x0 > xLow && x0 <= xHigh) ? 1.0 : 0.0;
+    const Value lo = std::max(x0, xLow);
+    const Value hi = std::min(x1, xHigh);
+    return (hi > lo) ? (hi - lo) / (x1 - x0) : 0.0;
+  }
+
+  // return mean of i-th centroid
+  inline Value mean(int i) const noexcept { return processed_[i].mean(); }
+
+  // return weight of i-th centroid
+  inline Weight weight(int i) const noexcept { return processed_[i].weight(); }
+
+  // append all unprocessed centroids into current unprocessed vector
+  void mergeUnprocessed(const std::vector<const TDigest*>& tdigests, Weight weightFactor) {
+    if (tdigests.size() == 0) return;
+
+    size_t total = unprocessed_.size();
+    for (auto& td : tdigests) {
+      total += td->unprocessed_.size();
+    }
+
+    unprocessed_.reserve(total);
+    for (auto& td : tdigests) {
+      const Weight factor = mergeFactor(*td, weightFactor);
+      if (factor == 1 && sameStorage(*td)) {
+        unprocessed_.insert(unprocessed_.end(), td->unprocessed_.cbegin(), td->unprocessed_.cend());
+      } else {
+        for (auto& centroid : td->unprocessed_) {
+          unprocessed_.emplace_back(mapFrom(*td, centroid.mean()), centroid.weight() * factor);
+        }
+      }
+      if (td->densePending_) {
+        for (Index i = 0; i < td->denseCounts_.size(); i++) {
+          const Value x = mapFrom(*td, td->denseLow_ + i);
+          if (td->denseCounts_[i] > 0) unprocessed_.emplace_back(x, td->denseCounts_[i] * factor);
+        }
+      }
+      unprocessedWeight_ += td->unprocessedWeight_ * factor;
+    }
+  }
+
+  // the multiplier from td's stored weights to ours when merging td with an extra weightFactor
+  Weight mergeFactor(const TDigest& td, Weight weightFactor) const {
+    return td.weightScale_ * weightFactor / weightScale_;
+  }
+
+  // the affine map from td's values to ours, before either log domain
+  Value mergeScale(const TDigest& td) const { return td.valueScale_ / valueScale_; }
+
+  Value mergeOffset(const TDigest& td) const { return (td.valueOffset_ - valueOffset_) / valueScale_; }
+
+  // whether td's stored means are ours as they are
+  bool sameStorage(const TDigest& td) const {
+    return td.logUnit_ == logUnit_ && mergeScale(td) == 1 && mergeOffset(td) == 0;
+  }
+
+  // one of td's stored means as one of ours
+  Value mapFrom(const TDigest& td, Value stored) const {
+    return sameStorage(td) ? stored : encode(td.decode(stored) * mergeScale(td) + mergeOffset(td));
+  }
+
+  bool transformed() const { return valueScale_ != 1 || valueOffset_ != 0; }
+
+  bool mapped() const { return logUnit_ > 0 || transformed(); }
+
+  Value encode(Value x) const { return (logUnit_ > 0) ? logEncode(x, logUnit_) : x; }
+
+  Value decode(Value stored) const { return (logUnit_ > 0) ? logDecode(stored, logUnit_) : stored; }
+
+  // the mean reported value over the stored interval [s0, s1], along which the weight is spread evenly
+  Value meanValue(Value s0, Value s1) const {
+    if (logUnit_ == 0 || !(s1 > s0)) return toValue((s0 + s1) / 2);
+    // an antiderivative of logDecode
+    auto integral = [&](Value s) { return logUnit_ * (std::exp(std::abs(s)) - std::abs(s)); };
+    return valueScale_ * (integral(s1) - integral(s0)) / (s1 - s0) + valueOffset_;
+  }
+
+  // count a sample in the dense domain, returning false if it is not an integer inside the domain
+  inline bool addDense(Value x, Weight w) {
+    const Value offset = x - denseLow_;
+    if (!(offset >= 0 && offset < denseCounts_.size()) || offset != std::floor(offset)) return false;
+    denseCounts_[static_cast<Index>(offset)] += w;
+    unprocessedWeight_ += w;
+    densePending_ = true;
+    return true;
+  }
+
+  // merge digests that are all dense over the same domain straight into the counts, returning false (having
+  // changed nothing) if any of them is not
+  bool mergeDense(std::vector<const TDigest*>::const_iterator iter, std::vector<const TDigest*>::const_iterator end,
+                  Weight weightFactor) {
+    for (auto td = iter; td != end; td++) {
+      if ((*td)->denseLow_ != denseLow_ || (*td)->denseCounts_.size() != denseCounts_.size()) return false;
+      if (!sameStorage(**td)) return false;
+    }
+    for (; iter != end; iter++) {
+      auto td = *iter;
+      const Weight factor = mergeFactor(*td, weightFactor);
+      for (auto& centroid : td->processed_) {
+        denseCounts_[static_cast<Index>(centroid.mean() - denseLow_)] += centroid.weight() * factor;
+      }
+      for (Index i = 0; i < denseCounts_.size(); i++) {
+        denseCounts_[i] += td->denseCounts_[i] * factor;
+      }
+      unprocessedWeight_ += (td->processedWeight_ + td->unprocessedWeight_) * factor;
+      densePending_ = true;
+    }
+    // the merged counts are pending and exact, so the watchers count them as they do observed samples
+    updateWatchers();
+    return true;
+  }
+
+  // fold the dense counts into processed_, which keeps one centroid per distinct value while dense
+  void flushDense() {
+    if (!densePending_) return;
+    unprocessed_.clear();
+    auto iter = processed_.cbegin();
+    for (Index i = 0; i < denseCounts_.size(); i++) {
+      if (denseCounts_[i] == 0) continue;
+      const Value x = denseLow_ + i;
+      while (iter != processed_.cend() && iter->mean() < x) unprocessed_.push_back(*(iter++));
+      Weight w = denseCounts_[i];
+      if (iter != processed_.cend() && iter->mean() == x) w += (iter++)->weight();
+      unprocessed_.emplace_back(x, w);
+      denseCounts_[i] = 0;
+    }
+    unprocessed_.insert(unprocessed_.end(), iter, processed_.cend());
+    processed_.swap(unprocessed_);
+    unprocessed_.clear();
+
+    processedWeight_ += unprocessedWeight_;
+    unprocessedWeight_ = 0;
+    densePending_ = false;
+    if (processed_.size() > 0) {
+      min_ = std::min(min_, processed_[0].mean());
+      max_ = std::max(max_, (processed_.cend() - 1)->mean());
+    }
+    updateCumulative();
+  }
+
+  // turn the counts into ordinary centroids and stop counting
+  void leaveDense() {
+    flushDense();
+    denseCounts_.clear();
+    denseCounts_.shrink_to_fit();
+  }
+
+  // merge all processed centroids together into a single sorted vector, compressed if it would outgrow
+  // maxProcessed_
+  void mergeProcessed(const std::vector<const TDigest*>& tdigests, Weight weightFactor) {
+    if (tdigests.size() == 0) return;
+
+    size_t total = 0;
+    CentroidListQueue pq(CentroidListComparator{});
+    // copies of the centroids of digests stored in another log domain, mapped into ours (which keeps them sorted)
+    std::vector<std::vector<Centroid>> remapped;
+    remapped.reserve(tdigests.size());
+    for (auto& td : tdigests) {
       auto& sorted = td->processed_;
       auto size = sorted.size();
       if (size > 0) {
-        pq.push(CentroidList(sorted));
+        const Weight factor = mergeFactor(*td, weightFactor);
+        if (td->logUnit_ == 0 && logUnit_ == 0) {
+          pq.push(CentroidList(sorted, factor, mergeScale(*td), mergeOffset(*td)));
+        } else if (sameStorage(*td)) {
+          pq.push(CentroidList(sorted, factor));
+        } else {
+          remapped.emplace_back();
+          for (auto& centroid : sorted) remapped.back().emplace_back(mapFrom(*td, centroid.mean()), centroid.weight());
+          pq.push(CentroidList(remapped.back(), factor));
+        }
         total += size;
-        processedWeight_ += td->processedWeight_;
+        processedWeight_ += td->processedWeight_ * factor;
       }
     }
     if (total == 0) return;
@@ -452,19 +1918,46 @@ class TDigest {
 
     std::vector<Centroid> sorted;
     VLOG(1) << "total " << total;
-    sorted.reserve(total);
+    const bool compress = total > maxProcessed_;
+    sorted.reserve(compress ? maxProcessed_ : total);
 
+    // when the merged centroids would not fit in maxProcessed_, compress them on their way out of the merge with
+    // the k1 limits of compressMerged, for the combined weight, so processed_ never holds more than a compressed
+    // digest whatever the compressions of the inputs
+    Weight wSoFar = 0;
+    Weight wLimit = processedWeight_ * integratedQ(1.0);
+    Value base = 0;
+    Weight w = 0;
+    Value dm = 0;
+    Value low = NAN;
+    Value high = NAN;
     while (!pq.empty()) {
       auto best = pq.top();
       pq.pop();
-      sorted.push_back(*(best.iter));
+      const Centroid centroid = best.current();
       if (best.advance()) pq.push(best);
+      if (std::isnan(low)) low = centroid.mean();
+      high = centroid.mean();
+      if (!compress) {
+        sorted.push_back(centroid);
+        continue;
+      }
+      if (w > 0 && wSoFar + centroid.weight() > wLimit) {
+        sorted.emplace_back(base + dm / w, w);
+        wLimit = processedWeight_ * integratedQ(integratedLocation(wSoFar / processedWeight_) + 1.0);
+        w = 0;
+        dm = 0;
+      }
+      if (w == 0) base = centroid.mean();
+      w += centroid.weight();
+      dm += centroid.weight() * (centroid.mean() - base);
+      wSoFar += centroid.weight();
     }
+    if (w > 0) sorted.emplace_back(base + dm / w, w);
     processed_ = std::move(sorted);
-    if( processed_.size() > 0 ) {
-      min_ = std::min(min_, processed_[0].mean());
-      max_ = std::max(max_, (processed_.cend() - 1)->mean());
-    }
+    min_ = std::min(min_, low);
+    max_ = std::max(max_, high);
+    enforceBound();
   }
 
   inline void processIfNecessary() {
@@ -478,52 +1971,104 @@ class TDigest {
     cumulative_.clear();
     cumulative_.reserve(n + 1);
     auto previous = 0.0;
+    uint64_t h = fingerprintMix(n, min_);
     for (Index i = 0; i < n; i++) {
       auto current = weight(i);
       auto halfCurrent = current / 2.0;
       cumulative_.push_back(previous + halfCurrent);
       previous = previous + current;
+      h = fingerprintMix(fingerprintMix(h, mean(i)), current);
     }
     cumulative_.push_back(previous);
+    h = fingerprintMix(fingerprintMix(fingerprintMix(h, max_), moments_.count()), moments_.sum());
+
+    if (tailSize_ > 0) {
+      lowSorted_.assign(lowTail_.cbegin(), lowTail_.cend());
+      std::sort(lowSorted_.begin(), lowSorted_.end());
+      highSorted_.assign(highTail_.cbegin(), highTail_.cend());
+      std::sort(highSorted_.begin(), highSorted_.end(), std::greater<Value>());
+      for (auto x : lowSorted_) h = fingerprintMix(h, x);
+      for (auto x : highSorted_) h = fingerprintMix(h, x);
+    }
+    fingerprint_ = h;
+    updateWatchers();
   }
 
   // merges unprocessed_ centroids and processed_ centroids together and processes them
   // when complete, unprocessed_ will be empty and processed_ will have at most maxProcessed_ centroids
   inline void process() {
+    generation_++;
+    if (dense()) {
+      flushDense();
+      return;
+    }
+    if (unprocessed_.empty() && processed_.empty()) return;
     CentroidComparator cc;
-    std::sort(unprocessed_.begin(), unprocessed_.end(), cc);
+    sortCentroids(unprocessed_, sortKeys_, sortScratch_);
     auto count = unprocessed_.size();
     unprocessed_.insert(unprocessed_.end(), processed_.cbegin(), processed_.cend());
     std::inplace_merge(unprocessed_.begin(), unprocessed_.begin() + count, unprocessed_.end(), cc);
 
     processedWeight_ += unprocessedWeight_;
     unprocessedWeight_ = 0;
-    processed_.clear();
+    compressMerged();
+  }
 
-    processed_.push_back(unprocessed_[0]);
-    Weight wSoFar = unprocessed_[0].weight();
-    Weight wLimit = processedWeight_ * integratedQ(1.0);
+  // compresses the sorted centroids in unprocessed_ into processed_, whose weight must already be in
+  // processedWeight_
+  void compressMerged() {
+    compressSorted(unprocessed_);
+    enforceBound();
+    updateCumulative();
+  }
 
-    auto end = unprocessed_.end();
-    for (auto iter = unprocessed_.cbegin() + 1; iter < end; iter++) {
-      auto& centroid = *iter;
-      Weight projectedW = wSoFar + centroid.weight();
-      if (projectedW <= wLimit) {
-        wSoFar = projectedW;
-        (processed_.end() - 1)->add(centroid);
-      } else {
-        auto k1 = integratedLocation(wSoFar / processedWeight_);
-        wLimit = processedWeight_ * integratedQ(k1 + 1.0);
-        wSoFar += centroid.weight();
-        processed_.emplace_back(centroid);
-      }
+  // in strict mode, compress processed_ again with tighter limits until it fits in maxProcessed_.  each pass
+  // lowers the compression used for the limits in proportion to the excess, and the limits reach the whole weight
+  // (a single centroid) once it drops below one, so the loop ends.
+  void enforceBound() {
+    if (!strictBound_ || processed_.size() <= maxProcessed_) return;
+    const Value compression = compression_;
+    while (processed_.size() > maxProcessed_) {
+      compression_ *= std::min(0.9, static_cast<Value>(maxProcessed_) / processed_.size());
+      boundScratch_.swap(processed_);
+      compressSorted(boundScratch_);
     }
-    unprocessed_.clear();
-    min_ = std::min(min_, processed_[0].mean());
-    VLOG(2) << "new min_ " << min_;
-    max_ = std::max(max_, (processed_.cend() - 1)->mean());
+    compression_ = compression;
+  }
+
+  // compresses the sorted centroids in merged into processed_ with the k1 limits of compression_, leaving merged
+  // empty
+  void compressSorted(std::vector<Centroid>& merged) {
+    processed_.clear();
+
+    // phase one: prefix weights of the merged input, then the k-boundaries found by searching the prefix for
+    // the first centroid that would overflow the current limit.  the limit only changes once per output centroid.
+    const Index n = merged.size();
+    prefix_.resize(n);
+    Weight wSoFar = 0;
+    for (Index i = 0; i < n; i++) {
+      wSoFar += merged[i].weight();
+      prefix_[i] = wSoFar;
+    }
+
+    // phase two: reduce each segment [start, end) into a single centroid with one division
+    Weight wLimit = processedWeight_ * integratedQ(1.0);
+    Index start = 0;
+    while (start < n) {
+      auto bound = std::upper_bound(prefix_.cbegin() + start + 1, prefix_.cend(), wLimit);
+      Index end = std::distance(prefix_.cbegin(), bound);
+      processed_.push_back(reduceCentroids(merged.data() + start, merged.data() + end));
+      if (end < n) {
+        auto k1 = integratedLocation(prefix_[end - 1] / processedWeight_);
+        wLimit = processedWeight_ * integratedQ(k1 + 1.0);
+      }
+      start = end;
+    }
+    merged.clear();
+    min_ = std::min(min_, processed_[0].mean());
+    VLOG(2) << "new min_ " << min_;
+    max_ = std::max(max_, (processed_.cend() - 1)->mean());
     VLOG(2) << "new max_ " << max_;
-    updateCumulative();
   }
 
   inline int checkWeights() { return checkWeights(processed_, processedWeight_); }
@@ -623,6 +2168,661 @@ class TDigest {
   }
 };
 
+// digests by key that remember which keys changed when, so exporters and caches visit only the digests changed since
+// the generation they last saw.  the map's generation advances with every change to any of its digests.
+template <typename Key>
+class KeyedTDigest {
+ public:
+  explicit KeyedTDigest(Value compression) : compression_(compression) {}
+
+  void add(const Key& key, Value x, Weight w = 1) { touch(key).digest.add(x, w); }
+
+  void merge(const Key& key, const TDigest* other) { touch(key).digest.merge(other); }
+
+  // change the compression of the digest for key in place, see TDigest::downsample.  a key never added to is left
+  // absent.
+  void downsample(const Key& key, Value compression) {
+    if (slots_.count(key) == 0) return;
+    touch(key).digest.downsample(compression);
+  }
+
+  // the digest for key, or null if nothing was ever added under it
+  const TDigest* find(const Key& key) const {
+    auto found = slots_.find(key);
+    return (found != slots_.end()) ? &found->second.digest : nullptr;
+  }
+
+  Index size() const { return slots_.size(); }
+
+  // every key with a digest, in key order
+  std::vector<Key> keys() const {
+    std::vector<Key> keys;
+    keys.reserve(slots_.size());
+    for (auto& slot : slots_) keys.push_back(slot.first);
+    return keys;
+  }
+
+  uint64_t generation() const { return generation_; }
+
+  // the keys changed after generation since, least recently changed first, each once
+  std::vector<Key> changedSince(uint64_t since) const {
+    std::vector<Key> keys;
+    for (auto iter = changed_.upper_bound(since); iter != changed_.end(); iter++) keys.push_back(iter->second);
+    return keys;
+  }
+
+ private:
+  struct Slot {
+    explicit Slot(Value compression) : digest(compression) {}
+
+    TDigest digest;
+    uint64_t generation = 0;
+  };
+
+  // find or create the slot for key and move it to the current generation
+  Slot& touch(const Key& key) {
+    auto iter = slots_.find(key);
+    if (iter == slots_.end()) {
+      iter = slots_.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(compression_))
+                 .first;
+    } else {
+      changed_.erase(iter->second.generation);
+    }
+    iter->second.generation = ++generation_;
+    changed_.emplace(generation_, key);
+    return iter->second;
+  }
+
+  Value compression_;
+
+  uint64_t generation_ = 0;
+
+  std::map<Key, Slot> slots_;
+
+  // the generation of each key's latest change, so the dirty keys since any generation are a range
+  std::map<uint64_t, Key> changed_;
+};
+
+// picks compressions from a target, either a byte budget or the rank error wanted at the median, and applies them
+// through TDigest::downsample.  a lower compression takes effect at once; a higher one only raises the limits of
+// later calls to process(), since detail already merged away cannot be recovered.  compressions are kept within
+// [minCompression, maxCompression] and a digest is only recompressed when its target moves by more than a factor of
+// slack, so repeated adjustments do not churn.
+class CompressionController {
+ public:
+  // digests adjusted together share bytes, split in proportion to the square root of their weights, which minimises
+  // the total count error (the sum of weight / compression) for a fixed sum of compressions.  a budget too small for
+  // every digest at minCompression is exceeded rather than starving any of them.
+  static CompressionController forBudget(size_t bytes, Value minCompression = 20, Value maxCompression = 1000) {
+    return CompressionController(bytes, 0, minCompression, maxCompression);
+  }
+
+  // a k1 centroid at the median spans pi / (2 compression) of the weight, so half of that is the rank error there
+  static CompressionController forError(Value rankError, Value minCompression = 20, Value maxCompression = 1000) {
+    CHECK_GT(rankError, 0);
+    return CompressionController(0, rankError, minCompression, maxCompression);
+  }
+
+  void setSlack(Value slack) {
+    CHECK_GE(slack, 1);
+    slack_ = slack;
+  }
+
+  // the compression the target asks of a single digest
+  Value target() const { return clamp(rankError_ > 0 ? M_PI / (4 * rankError_) : unitsFor(1)); }
+
+  // move digest toward the target, returning whether it was recompressed
+  bool adjust(TDigest* digest) const {
+    const Value t = target();
+    if (!shouldMove(*digest, t)) return false;
+    digest->downsample(t);
+    return true;
+  }
+
+  // move every digest of the map toward its target, returning how many were recompressed
+  template <typename Key>
+  Index adjust(KeyedTDigest<Key>* digests) const {
+    const std::vector<Key> keys = digests->keys();
+    std::vector<Value> targets(keys.size(), target());
+    if (rankError_ == 0) {
+      Value roots = 0;
+      for (size_t i = 0; i < keys.size(); i++) {
+        targets[i] = std::sqrt(digests->find(keys[i])->totalWeight());
+        roots += targets[i];
+      }
+      const Value units = unitsFor(keys.size());
+      for (auto& t : targets) t = clamp(roots > 0 ? units * t / roots : units / keys.size());
+    }
+    Index changed = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (!shouldMove(*digests->find(keys[i]), targets[i])) continue;
+      digests->downsample(keys[i], targets[i]);
+      changed++;
+    }
+    return changed;
+  }
+
+ private:
+  CompressionController(size_t bytes, Value rankError, Value minCompression, Value maxCompression)
+      : bytes_(bytes), rankError_(rankError), minCompression_(minCompression), maxCompression_(maxCompression) {
+    CHECK_GT(minCompression, 0);
+    CHECK_LE(minCompression, maxCompression);
+  }
+
+  // whether digest should move to compression t.  raising an error targeted digest is only worth it once its
+  // centroids show a larger error than wanted.
+  bool shouldMove(const TDigest& digest, Value t) const {
+    const Value current = digest.compression();
+    if (t * slack_ < current) return true;
+    if (t <= current * slack_) return false;
+    return rankError_ == 0 || digest.rankError() > rankError_;
+  }
+
+  // the sum of compressions that n digests fit in the budget, each costing its object and a size linear in
+  // compression
+  Value unitsFor(size_t n) const {
+    const Value perUnit = static_cast<Value>(TDigest::memoryBytes(1000) - sizeof(TDigest)) / 1000;
+    const Value available = static_cast<Value>(bytes_) - static_cast<Value>(n * sizeof(TDigest));
+    return std::max<Value>(0, available / perUnit);
+  }
+
+  Value clamp(Value compression) const { return std::min(maxCompression_, std::max(minCompression_, compression)); }
+
+  size_t bytes_;
+
+  // zero for a byte budget
+  Value rankError_;
+
+  Value minCompression_;
+
+  Value maxCompression_;
+
+  Value slack_ = 1.25;
+};
+
+// a bounded cache of merged digests, keyed by the multiset of fingerprints of the merged inputs.  merging the same
+// processed digests again, in any order, returns the earlier result after O(k) hashing instead of a full merge.
+// the least recently used result is dropped once capacity results are held.  inputs with unprocessed samples are
+// merged without touching the cache.
+class MergeCache {
+ public:
+  MergeCache(Value compression, Index capacity) : compression_(compression), capacity_(capacity) {}
+
+  std::shared_ptr<const TDigest> merge(const std::vector<const TDigest*>& digests) {
+    Key key;
+    key.reserve(digests.size());
+    for (auto digest : digests) {
+      if (digest->haveUnprocessed()) return mergeDigests(digests);
+      key.push_back(digest->fingerprint());
+    }
+    std::sort(key.begin(), key.end());
+
+    auto found = index_.find(key);
+    if (found != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, found->second);
+      hits_++;
+      return found->second->second;
+    }
+
+    auto merged = mergeDigests(digests);
+    entries_.emplace_front(key, merged);
+    index_.emplace(std::move(key), entries_.begin());
+    if (entries_.size() > capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    return merged;
+  }
+
+  Index size() const { return entries_.size(); }
+
+  Index hits() const { return hits_; }
+
+  void clear() {
+    entries_.clear();
+    index_.clear();
+  }
+
+ private:
+  using Key = std::vector<uint64_t>;
+  using Entry = std::pair<Key, std::shared_ptr<const TDigest>>;
+
+  std::shared_ptr<const TDigest> mergeDigests(const std::vector<const TDigest*>& digests) const {
+    auto merged = std::make_shared<TDigest>(compression_);
+    merged->add(digests);
+    merged->compress();
+    return merged;
+  }
+
+  Value compression_;
+
+  Index capacity_;
+
+  Index hits_ = 0;
+
+  // most recently used first
+  std::list<Entry> entries_;
+
+  std::map<Key, std::list<Entry>::iterator> index_;
+};
+
+// cos(x) for x in [0, pi], accurate to double precision and usable in constant expressions
+constexpr Value constexprCos(Value x) {
+  // reflect into [0, pi/2] where the series converges quickly
+  Value sign = 1;
+  if (x > M_PI / 2) {
+    x = M_PI - x;
+    sign = -1;
+  }
+  Value term = 1;
+  Value sum = 1;
+  for (int i = 1; i < 20; i++) {
+    term *= -x * x / ((2 * i - 1) * (2 * i));
+    sum += term;
+  }
+  return sign * sum;
+}
+
+// the k1 scale function tabulated at integer k: q[k] is the quantile at which centroid scale k begins
+template <int Compression>
+struct ScaleTable {
+  Value q[Compression + 1];
+
+  constexpr ScaleTable() : q() {
+    for (int k = 0; k < Compression; k++) {
+      q[k] = (1 - constexprCos(k * M_PI / Compression)) / 2;
+    }
+    q[Compression] = 1;
+  }
+};
+
+// A t-digest whose compression is a compile time constant.  Centroids are kept in inline arrays, so the digest
+// never allocates and is trivially copyable: it can be memcpy'd into shared memory or a network buffer as-is.
+// Compaction places centroid boundaries on a constexpr table of the scale function instead of evaluating trig, and
+// never produces more than kMaxProcessed centroids.
+template <int Compression, Index BufferSize = 8 * Compression>
+class FixedTDigest {
+  static_assert(Compression > 0, "compression must be positive");
+  static_assert(BufferSize > 0, "buffer size must be positive");
+
+  template <int, Index>
+  friend class FixedTDigest;
+
+ public:
+  static constexpr Index kMaxProcessed = 2 * Compression;
+
+  static constexpr Index kMaxUnprocessed = BufferSize;
+
+  Value compression() const { return Compression; }
+
+  const Centroid* processed() const { return processed_.data(); }
+
+  Index processedSize() const { return processedSize_; }
+
+  Index unprocessedSize() const { return unprocessedSize_; }
+
+  Weight processedWeight() const { return processedWeight_; }
+
+  Weight unprocessedWeight() const { return unprocessedWeight_; }
+
+  long totalWeight() const { return static_cast<long>(processedWeight_ + unprocessedWeight_); }
+
+  void add(Value x) { add(x, 1); }
+
+  inline bool add(Value x, Weight w) {
+    if (std::isnan(x)) {
+      return false;
+    }
+    push(Centroid(x, w));
+    return true;
+  }
+
+  // merge in a fixed digest of any compression
+  template <int OtherCompression, Index OtherBufferSize>
+  void merge(const FixedTDigest<OtherCompression, OtherBufferSize>& other) {
+    for (Index i = 0; i < other.processedSize_; i++) push(other.processed_[i]);
+    for (Index i = 0; i < other.unprocessedSize_; i++) push(other.unprocessed_[i]);
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  // merge in a dynamic t-digest
+  void merge(const TDigest& other) {
+    const Weight scale = other.weightScale();
+    for (auto& c : other.processed()) push(Centroid(other.toValue(c.mean()), c.weight() * scale));
+    for (auto& c : other.unprocessed()) push(Centroid(other.toValue(c.mean()), c.weight() * scale));
+    for (Index i = 0; i < other.denseCounts().size(); i++) {
+      const Weight w = other.denseCounts()[i] * scale;
+      if (w > 0) push(Centroid(other.toValue(other.denseLow() + i), w));
+    }
+    // the moments keep the exact extremes, which the centroid means only bound
+    const Moments moments = other.moments();
+    if (moments.count() > 0) {
+      min_ = std::min(min_, moments.min());
+      max_ = std::max(max_, moments.max());
+    }
+  }
+
+  // convert to a dynamic t-digest with the same compression and buffer sizes
+  TDigest toTDigest() const {
+    return TDigest(std::vector<Centroid>(processed_.cbegin(), processed_.cbegin() + processedSize_),
+                   std::vector<Centroid>(unprocessed_.cbegin(), unprocessed_.cbegin() + unprocessedSize_),
+                   Compression, BufferSize, kMaxProcessed, min_, max_);
+  }
+
+  inline void compress() { process(); }
+
+  Value cdf(Value x) {
+    if (unprocessedSize_ > 0) process();
+    return cdfProcessed(x);
+  }
+
+  Value cdfProcessed(Value x) const {
+    return TDigest::cdfOf(processed_.data(), cumulative_.data(), processedSize_, processedWeight_, min_, max_, x);
+  }
+
+  Value quantile(Value q) {
+    if (unprocessedSize_ > 0) process();
+    return quantileProcessed(q);
+  }
+
+  Value quantileProcessed(Value q) const {
+    return TDigest::quantileOf(processed_.data(), cumulative_.data(), processedSize_, processedWeight_, min_, max_,
+                               q);
+  }
+
+ private:
+  static constexpr ScaleTable<Compression> kScale{};
+
+  Value min_ = std::numeric_limits<Value>::max();
+
+  Value max_ = std::numeric_limits<Value>::lowest();
+
+  Index processedSize_ = 0;
+
+  Index unprocessedSize_ = 0;
+
+  Weight processedWeight_ = 0;
+
+  Weight unprocessedWeight_ = 0;
+
+  std::array<Centroid, kMaxProcessed> processed_;
+
+  // leaves room for processed_ to be merged in behind the unprocessed centroids
+  std::array<Centroid, BufferSize + kMaxProcessed> unprocessed_;
+
+  std::array<Weight, kMaxProcessed + 1> cumulative_;
+
+  inline void push(const Centroid& centroid) {
+    if (unprocessedSize_ == BufferSize) process();
+    unprocessed_[unprocessedSize_++] = centroid;
+    unprocessedWeight_ += centroid.weight();
+    min_ = std::min(min_, centroid.mean());
+    max_ = std::max(max_, centroid.mean());
+  }
+
+  void process() {
+    if (unprocessedSize_ == 0) return;
+    std::sort(unprocessed_.begin(), unprocessed_.begin() + unprocessedSize_, CentroidComparator());
+
+    // merge processed_ in from the back so that no scratch space is needed
+    Index u = unprocessedSize_;
+    Index p = processedSize_;
+    const Index n = u + p;
+    for (Index out = n; p > 0;) {
+      if (u > 0 && unprocessed_[u - 1].mean() > processed_[p - 1].mean()) {
+        unprocessed_[--out] = unprocessed_[--u];
+      } else {
+        unprocessed_[--out] = processed_[--p];
+      }
+    }
+
+    // the total is summed in merge order so that the last prefix weight lands exactly on the final limit
+    Weight total = 0;
+    for (Index i = 0; i < n; i++) total += unprocessed_[i].weight();
+
+    // a centroid may grow until the running weight crosses the end of the scale cell it started in.  that allows
+    // at most two centroids per cell, and the cell only moves forward so the table walk is O(Compression).
+    processedSize_ = 0;
+    int k = 0;
+    Index start = 0;
+    Weight wSoFar = unprocessed_[0].weight();
+    Weight wLimit = total * kScale.q[1];
+    for (Index i = 1; i < n; i++) {
+      const Weight projectedW = wSoFar + unprocessed_[i].weight();
+      if (projectedW > wLimit) {
+        emit(start, i);
+        while (k + 1 < Compression && total * kScale.q[k + 1] <= wSoFar) k++;
+        wLimit = total * kScale.q[k + 1];
+        start = i;
+      }
+      wSoFar = projectedW;
+    }
+    emit(start, n);
+
+    processedWeight_ = total;
+    unprocessedWeight_ = 0;
+    unprocessedSize_ = 0;
+    updateCumulative();
+  }
+
+  inline void emit(Index start, Index end) {
+    CHECK_LT(processedSize_, kMaxProcessed);
+    processed_[processedSize_++] = reduceCentroids(unprocessed_.data() + start, unprocessed_.data() + end);
+  }
+
+  void updateCumulative() {
+    auto previous = 0.0;
+    for (Index i = 0; i < processedSize_; i++) {
+      auto current = processed_[i].weight();
+      cumulative_[i] = previous + current / 2.0;
+      previous = previous + current;
+    }
+    cumulative_[processedSize_] = previous;
+  }
+};
+
+template <int Compression, Index BufferSize>
+constexpr ScaleTable<Compression> FixedTDigest<Compression, BufferSize>::kScale;
+
+// A t-digest fed with unsigned integers, such as nanosecond latencies or byte counts.  Samples are buffered as
+// integers and radix sorted, runs of equal values collapse into a single centroid, and the sorted runs are merged
+// into an ordinary TDigest, where centroid means are floating point as usual.
+class IntegerTDigest {
+ public:
+  IntegerTDigest() : IntegerTDigest(1000) {}
+
+  explicit IntegerTDigest(Value compression) : IntegerTDigest(compression, 0) {}
+
+  IntegerTDigest(Value compression, Index bufferSize)
+      : digest_(compression, bufferSize), maxUnprocessed_(TDigest::unprocessedSize(bufferSize, compression)) {
+    unprocessed_.reserve(maxUnprocessed_);
+  }
+
+  Value compression() const { return digest_.compression(); }
+
+  long totalWeight() const { return digest_.totalWeight() + static_cast<long>(unprocessed_.size()); }
+
+  inline void add(uint64_t x) {
+    unprocessed_.push_back(x);
+    if (unprocessed_.size() >= maxUnprocessed_) flush();
+  }
+
+  void add(const uint64_t* values, size_t n) {
+    while (n > 0) {
+      const size_t room = std::min(n, maxUnprocessed_ - unprocessed_.size());
+      unprocessed_.insert(unprocessed_.end(), values, values + room);
+      values += room;
+      n -= room;
+      if (unprocessed_.size() >= maxUnprocessed_) flush();
+    }
+  }
+
+  void merge(const TDigest* other) { digest_.merge(other); }
+
+  Value cdf(Value x) {
+    flush();
+    return digest_.cdf(x);
+  }
+
+  Value quantile(Value q) {
+    flush();
+    return digest_.quantile(q);
+  }
+
+  // the digest holding every sample added so far
+  const TDigest& digest() {
+    flush();
+    return digest_;
+  }
+
+  // sort the buffered integers and merge them into the digest
+  void flush() {
+    if (unprocessed_.empty()) return;
+    scratch_.resize(unprocessed_.size());
+    auto sorted = radixSort(unprocessed_.data(), scratch_.data(), unprocessed_.size(), [](uint64_t x) { return x; });
+    const auto end = sorted + unprocessed_.size();
+
+    runs_.clear();
+    for (auto iter = sorted; iter != end;) {
+      auto run = iter;
+      while (++iter != end && *iter == *run) {
+      }
+      runs_.emplace_back(static_cast<Value>(*run), static_cast<Weight>(iter - run));
+    }
+    unprocessed_.clear();
+    digest_.addSorted(runs_.data(), runs_.data() + runs_.size());
+  }
+
+ private:
+  TDigest digest_;
+
+  Index maxUnprocessed_;
+
+  std::vector<uint64_t> unprocessed_;
+
+  std::vector<uint64_t> scratch_;
+
+  std::vector<Centroid> runs_;
+};
+
+// A digest for the long tail of keys that only ever see a handful of samples.  Up to Capacity unit weight values are
+// kept raw in an inline array and quantiles over them are exact.  The first add past Capacity, any weighted add and
+// any merge with a TDigest promote the values into a full TDigest, which is only allocated at that point.
+template <Index Capacity = 128>
+class SmallTDigest {
+  static_assert(Capacity > 0, "capacity must be positive");
+
+ public:
+  SmallTDigest() : SmallTDigest(1000) {}
+
+  explicit SmallTDigest(Value compression) : compression_(compression) {}
+
+  Value compression() const { return compression_; }
+
+  bool promoted() const { return digest_ != nullptr; }
+
+  // the promoted digest, or nullptr while the values are still held exactly
+  const TDigest* digest() const { return digest_.get(); }
+
+  TDigest* digest() { return digest_.get(); }
+
+  long totalWeight() const { return promoted() ? digest_->totalWeight() : static_cast<long>(size_); }
+
+  void add(Value x) { add(x, 1); }
+
+  inline bool add(Value x, Weight w) {
+    if (std::isnan(x)) {
+      return false;
+    }
+    if (!promoted() && w == 1 && size_ < Capacity) {
+      values_[size_++] = x;
+      sorted_ = false;
+      return true;
+    }
+    promote();
+    return digest_->add(x, w);
+  }
+
+  void merge(const SmallTDigest& other) {
+    if (other.promoted()) {
+      merge(other.digest());
+      return;
+    }
+    for (Index i = 0; i < other.size_; i++) add(other.values_[i]);
+  }
+
+  void merge(const TDigest* other) {
+    promote();
+    digest_->merge(other);
+  }
+
+  Value cdf(Value x) {
+    if (promoted()) return digest_->cdf(x);
+    sort();
+    if (size_ == 0) {
+      return 0.0;
+    } else if (size_ == 1) {
+      return (x < values_[0]) ? 0.0 : (x > values_[0]) ? 1.0 : 0.5;
+    } else if (x <= values_[0]) {
+      return 0.0;
+    } else if (x >= values_[size_ - 1]) {
+      return 1.0;
+    }
+    // interpolate between the centers of the neighbouring samples, as cdfProcessed does for unit centroids
+    const auto i = std::distance(values_.cbegin(), std::upper_bound(values_.cbegin(), values_.cbegin() + size_, x));
+    const auto fraction = (x - values_[i - 1]) / (values_[i] - values_[i - 1]);
+    return (i - 0.5 + fraction) / size_;
+  }
+
+  Value quantile(Value q) {
+    if (promoted()) return digest_->quantile(q);
+    if (q < 0 || q > 1) {
+      LOG(ERROR) << "q should be in [0,1], got " << q;
+      return NAN;
+    }
+    sort();
+    if (size_ == 0) {
+      return NAN;
+    }
+    // each sample owns a unit of weight centered on it, so interpolate between the two nearest centers
+    auto index = q * size_;
+    if (index < 0.5) {
+      return values_[0];
+    } else if (size_ - index <= 0.5) {
+      return values_[size_ - 1];
+    }
+    index -= 0.5;
+    const auto i = static_cast<Index>(index);
+    return values_[i] + (index - i) * (values_[i + 1] - values_[i]);
+  }
+
+ private:
+  Value compression_;
+
+  Index size_ = 0;
+
+  bool sorted_ = true;
+
+  std::array<Value, Capacity> values_;
+
+  std::unique_ptr<TDigest> digest_;
+
+  inline void sort() {
+    if (!sorted_) {
+      std::sort(values_.begin(), values_.begin() + size_);
+      sorted_ = true;
+    }
+  }
+
+  void promote() {
+    if (promoted()) return;
+    digest_.reset(new TDigest(compression_));
+    for (Index i = 0; i < size_; i++) digest_->add(values_[i]);
+    size_ = 0;
+  }
+};
+
 }  // namespace tdigest2
 
 #endif  // TDIGEST2_TDIGEST_H_
@@ -0,0 +1,200 @@
+/*
+ * Licensed to Derrick R. Burns under one or more
+ * contributor license agreements.  See the NOTICES file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Micro benchmarks for the t-digest.  Build alongside tdigest_test.cpp and run without arguments; each line
+// reports nanoseconds per element.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#include "tdigest.h"
+
+namespace sbench {
+
+using Clock = std::chrono::steady_clock;
+
+static double nanosPerElement(Clock::duration elapsed, size_t elements) {
+  return std::chrono::duration<double, std::nano>(elapsed).count() / elements;
+}
+
+static std::vector<tdigest::Centroid> centroids(size_t n, bool heavyTailed) {
+  std::mt19937_64 gen(n);
+  std::uniform_real_distribution<> uniform(0.0, 1.0);
+  std::lognormal_distribution<> lognormal(0.0, 2.0);
+  std::vector<tdigest::Centroid> result;
+  result.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    result.emplace_back(heavyTailed ? lognormal(gen) : uniform(gen), 1);
+  }
+  return result;
+}
+
+// unprocessed_ is 8x compression long, so 800 and 8000 are the buffers for the usual compressions of 100 and 1000
+static void benchSort() {
+  std::vector<tdigest::CentroidKey> keys;
+  std::vector<tdigest::CentroidKey> scratch;
+  for (size_t n : {800, 1600, 4000, 8000, 16000, 80000}) {
+    for (bool heavyTailed : {false, true}) {
+      const auto input = centroids(n, heavyTailed);
+      const size_t rounds = 4000000 / n;
+      std::vector<tdigest::Centroid> buffer;
+
+      Clock::duration comparator{0};
+      Clock::duration keyed{0};
+      for (size_t r = 0; r < rounds; r++) {
+        buffer = input;
+        auto start = Clock::now();
+        std::sort(buffer.begin(), buffer.end(), tdigest::CentroidComparator());
+        comparator += Clock::now() - start;
+
+        buffer = input;
+        start = Clock::now();
+        tdigest::sortCentroids(buffer, keys, scratch);
+        keyed += Clock::now() - start;
+      }
+      printf("sort n=%-6zu %-10s std::sort %6.1f ns  sortCentroids %6.1f ns\n", n,
+             heavyTailed ? "lognormal" : "uniform", nanosPerElement(comparator, n * rounds),
+             nanosPerElement(keyed, n * rounds));
+    }
+  }
+}
+
+static void benchAdd() {
+  for (double compression : {100.0, 1000.0}) {
+    const auto input = centroids(10000000, true);
+    tdigest::TDigest digest(compression);
+    auto start = Clock::now();
+    for (auto& c : input) digest.add(c.mean());
+    digest.compress();
+    printf("add compression=%-6g %6.1f ns\n", compression, nanosPerElement(Clock::now() - start, input.size()));
+  }
+}
+
+static void benchIntegerAdd() {
+  std::mt19937_64 gen(1);
+  std::lognormal_distribution<> latency(12.0, 1.5);
+  std::vector<uint64_t> input(10000000);
+  for (auto& x : input) x = static_cast<uint64_t>(latency(gen));
+  for (double compression : {100.0, 1000.0}) {
+    tdigest::IntegerTDigest digest(compression);
+    auto start = Clock::now();
+    digest.add(input.data(), input.size());
+    digest.flush();
+    printf("integer add compression=%-6g %6.1f ns\n", compression,
+           nanosPerElement(Clock::now() - start, input.size()));
+  }
+}
+
+// a 160 bucket cumulative histogram imported into a fresh digest, and into one that is already full
+static void benchImport() {
+  std::vector<double> bounds;
+  std::vector<double> cumulative;
+  for (int i = 1; i <= 160; i++) {
+    bounds.push_back(i * 1.5);
+    cumulative.push_back(i * 10.0);
+  }
+  for (double compression : {100.0, 1000.0}) {
+    const size_t rounds = 10000;
+    Clock::duration fresh{0};
+    for (size_t r = 0; r < rounds; r++) {
+      tdigest::TDigest digest(compression);
+      auto start = Clock::now();
+      digest.addCumulativeBuckets(bounds.data(), cumulative.data(), bounds.size(), 0.0);
+      fresh += Clock::now() - start;
+    }
+
+    tdigest::TDigest digest(compression);
+    auto start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+      digest.addCumulativeBuckets(bounds.data(), cumulative.data(), bounds.size(), 0.0);
+    }
+    printf("import 160 buckets compression=%-6g fresh %8.1f ns  full %8.1f ns\n", compression,
+           nanosPerElement(fresh, rounds), nanosPerElement(Clock::now() - start, rounds));
+  }
+}
+
+// drawing through quantile(uniform) against the sampler's grid
+static void benchSample() {
+  const auto input = centroids(1000000, true);
+  for (double compression : {100.0, 1000.0}) {
+    tdigest::TDigest digest(compression);
+    for (auto& c : input) digest.add(c.mean());
+    digest.compress();
+
+    const size_t draws = 10000000;
+    std::mt19937_64 gen(1);
+    std::uniform_real_distribution<> uniform(0.0, 1.0);
+    std::vector<double> out(draws);
+    auto start = Clock::now();
+    for (auto& x : out) x = digest.quantileProcessed(uniform(gen));
+    const auto viaQuantile = Clock::now() - start;
+
+    start = Clock::now();
+    tdigest::TDigest::Sampler sampler(digest);
+    sampler.sample(out.data(), out.size(), gen);
+    printf("sample compression=%-6g quantile %6.1f ns  sampler %6.1f ns\n", compression,
+           nanosPerElement(viaQuantile, draws), nanosPerElement(Clock::now() - start, draws));
+  }
+}
+
+// relative quantile error and centroid count of linear and log domain digests on data spanning six orders of
+// magnitude
+static void benchLogDomain() {
+  std::mt19937_64 gen(1);
+  std::lognormal_distribution<> latency(0.0, 2.5);
+  std::vector<double> input(1000000);
+  for (auto& x : input) x = latency(gen);
+  std::vector<double> sorted = input;
+  std::sort(sorted.begin(), sorted.end());
+
+  for (double unit : {0.0, 1e-6}) {
+    for (double compression : {25.0, 50.0, 100.0, 200.0, 1000.0}) {
+      tdigest::TDigest digest(compression);
+      if (unit > 0) digest.setLogDomain(unit);
+      auto start = Clock::now();
+      for (double x : input) digest.add(x);
+      digest.compress();
+      const auto elapsed = Clock::now() - start;
+
+      double worst = 0;
+      double median = 0;
+      for (double q : {0.001, 0.01, 0.1, 0.5, 0.9, 0.99, 0.999, 0.9999}) {
+        const double exact = sorted[static_cast<size_t>(q * (sorted.size() - 1))];
+        const double error = std::abs(digest.quantile(q) - exact) / exact;
+        worst = std::max(worst, error);
+        if (q == 0.5) median = error;
+      }
+      printf("%-6s compression=%-6g centroids %5zu  max relative error %8.2e  median %8.2e  add %5.1f ns\n",
+             unit > 0 ? "log" : "linear", compression, digest.processed().size(), worst, median,
+             nanosPerElement(elapsed, input.size()));
+    }
+  }
+}
+
+}  // namespace sbench
+
+int main() {
+  sbench::benchSort();
+  sbench::benchAdd();
+  sbench::benchIntegerAdd();
+  sbench::benchImport();
+  sbench::benchSample();
+  sbench::benchLogDomain();
+  return 0;
+}
@@ -15,7 +15,12 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <random>
+#include <string>
 
 #include "glog/logging.h"
 #include "gtest/gtest.h"
@@ -245,6 +250,957 @@ TEST_F(TDigestTest, Montonicity) {
   }
 }
 
+TEST_F(TDigestTest, ProcessPreservesMass) {
+  tdigest::TDigest digest(100);
+  std::uniform_real_distribution<> reals(0.0, 1000.0);
+  std::uniform_int_distribution<> ints(1, 5);
+  std::random_device gen;
+  double sum = 0;
+  double weight = 0;
+  for (int i = 0; i < 50000; ++i) {
+    const double x = reals(gen);
+    const double w = ints(gen);
+    digest.add(x, w);
+    sum += x * w;
+    weight += w;
+  }
+  digest.compress();
+
+  double processedSum = 0;
+  double processedWeight = 0;
+  for (auto centroid : digest.processed()) {
+    processedSum += centroid.mean() * centroid.weight();
+    processedWeight += centroid.weight();
+  }
+  EXPECT_EQ(weight, processedWeight);
+  EXPECT_NEAR(1.0, processedSum / sum, 1e-9);
+  EXPECT_LE(digest.processed().size(), digest.maxProcessed());
+}
+
+TEST_F(TDigestTest, SortCentroids) {
+  std::random_device gen;
+  std::normal_distribution<> normal(0.0, 1e6);
+  std::vector<tdigest::CentroidKey> keys;
+  std::vector<tdigest::CentroidKey> scratch;
+  for (size_t n : {size_t(10), tdigest::kRadixSortThreshold, 5 * tdigest::kRadixSortThreshold}) {
+    std::vector<tdigest::Centroid> centroids;
+    for (size_t i = 0; i < n; ++i) {
+      centroids.emplace_back((i % 7 == 0) ? 0.0 : normal(gen), 1 + i % 3);
+    }
+    auto expected = centroids;
+    std::stable_sort(expected.begin(), expected.end(), tdigest::CentroidComparator());
+    tdigest::sortCentroids(centroids, keys, scratch);
+    ASSERT_EQ(expected.size(), centroids.size());
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_EQ(expected[i].mean(), centroids[i].mean());
+    }
+  }
+}
+
+TEST_F(TDigestTest, FixedDigest) {
+  using Fixed = tdigest::FixedTDigest<100>;
+  static_assert(std::is_trivially_copyable<Fixed>::value, "fixed digests must be memcpy-able");
+
+  Fixed fixed;
+  tdigest::TDigest dynamic(100);
+  std::uniform_real_distribution<> reals(0.0, 1.0);
+  std::random_device gen;
+  double lowest = INFINITY;
+  double highest = -INFINITY;
+  for (int i = 0; i < 100000; i++) {
+    const double x = reals(gen);
+    fixed.add(x);
+    dynamic.add(x);
+    lowest = std::min(lowest, x);
+    highest = std::max(highest, x);
+  }
+  fixed.compress();
+  EXPECT_LE(fixed.processedSize(), Fixed::kMaxProcessed);
+  EXPECT_EQ(100000, fixed.totalWeight());
+
+  std::unique_ptr<Fixed> copy(new Fixed);
+  std::memcpy(static_cast<void*>(copy.get()), &fixed, sizeof(Fixed));
+  for (double q : {0.001, 0.01, 0.1, 0.5, 0.9, 0.99, 0.999}) {
+    EXPECT_NEAR(dynamic.quantile(q), fixed.quantile(q), 0.005) << "q = " << q;
+    EXPECT_EQ(fixed.quantile(q), copy->quantile(q)) << "q = " << q;
+  }
+
+  tdigest::FixedTDigest<200> merged;
+  merged.merge(fixed);
+  merged.merge(dynamic);
+  EXPECT_EQ(200000, merged.totalWeight());
+  Fixed fromDynamic;
+  fromDynamic.merge(dynamic);
+  EXPECT_DOUBLE_EQ(lowest, fromDynamic.quantile(0));
+  EXPECT_DOUBLE_EQ(highest, fromDynamic.quantile(1));
+
+  auto converted = fixed.toTDigest();
+  EXPECT_EQ(fixed.quantile(0), converted.quantile(0));
+  EXPECT_EQ(fixed.quantile(1), converted.quantile(1));
+  dynamic.merge(&converted);
+  EXPECT_EQ(200000, dynamic.totalWeight());
+  EXPECT_NEAR(0.5, dynamic.quantile(0.5), 0.01);
+}
+
+TEST_F(TDigestTest, SmallDigest) {
+  tdigest::SmallTDigest<64> digest(100);
+  std::random_device gen;
+  std::uniform_real_distribution<> reals(0.0, 100.0);
+  std::uniform_real_distribution<> qvalue(0.0, 1.0);
+
+  std::vector<double> values;
+  for (int i = 0; i < 64; ++i) {
+    values.push_back(reals(gen));
+    digest.add(values.back());
+  }
+  std::sort(values.begin(), values.end());
+  EXPECT_FALSE(digest.promoted());
+
+  std::vector<double> testValues{0.0, 1.0e-10, qvalue(gen), 0.5, 1.0 - 1e-10, 1.0};
+  for (auto q : testValues) {
+    EXPECT_DOUBLE_EQ(quantile(q, values), digest.quantile(q)) << "q = " << q;
+  }
+  EXPECT_EQ(0.0, digest.cdf(values.front()));
+  EXPECT_EQ(1.0, digest.cdf(values.back()));
+  EXPECT_NEAR(0.5, digest.cdf(quantile(0.5, values)), 1e-9);
+
+  values.push_back(reals(gen));
+  digest.add(values.back());
+  std::sort(values.begin(), values.end());
+  EXPECT_TRUE(digest.promoted());
+  EXPECT_EQ(65, digest.totalWeight());
+  EXPECT_NEAR(quantile(0.5, values), digest.quantile(0.5), 1e-9);
+}
+
+TEST_F(TDigestTest, IntegerDigest) {
+  tdigest::IntegerTDigest digest(100);
+  tdigest::TDigest reference(100);
+  std::random_device gen;
+  std::lognormal_distribution<> latency(12.0, 1.5);
+
+  std::vector<uint64_t> values;
+  for (int i = 0; i < 100000; ++i) {
+    values.push_back(static_cast<uint64_t>(latency(gen)));
+    reference.add(static_cast<double>(values.back()));
+  }
+  digest.add(values.data(), values.size() / 2);
+  for (size_t i = values.size() / 2; i < values.size(); ++i) {
+    digest.add(values[i]);
+  }
+  EXPECT_EQ(100000, digest.totalWeight());
+
+  std::sort(values.begin(), values.end());
+  for (double q : {0.01, 0.1, 0.5, 0.9, 0.99}) {
+    const double exact = values[static_cast<size_t>(q * values.size())];
+    EXPECT_NEAR(1.0, digest.quantile(q) / exact, 0.05) << "q = " << q;
+    EXPECT_NEAR(1.0, digest.quantile(q) / reference.quantile(q), 0.05) << "q = " << q;
+  }
+}
+
+TEST_F(TDigestTest, DenseDomain) {
+  tdigest::TDigest digest(100);
+  digest.setDenseDomain(0, 4095);
+  std::random_device gen;
+  std::geometric_distribution<> depth(0.01);
+
+  std::map<int, int> counts;
+  for (int i = 0; i < 100000; ++i) {
+    const int x = std::min(depth(gen), 4095);
+    counts[x]++;
+    digest.add(x);
+  }
+  EXPECT_TRUE(digest.dense());
+  EXPECT_EQ(100000, digest.totalWeight());
+  digest.compress();
+  ASSERT_EQ(counts.size(), digest.processed().size());
+  auto expected = counts.cbegin();
+  for (auto centroid : digest.processed()) {
+    EXPECT_EQ(expected->first, centroid.mean());
+    EXPECT_EQ(expected->second, centroid.weight());
+    ++expected;
+  }
+
+  tdigest::TDigest other(100);
+  other.setDenseDomain(0, 4095);
+  other.add(7, 3);
+  digest.merge(&other);
+  EXPECT_TRUE(digest.dense());
+  EXPECT_EQ(100003, digest.totalWeight());
+
+  tdigest::TDigest ordinary(100);
+  ordinary.merge(&digest);
+  EXPECT_EQ(100003, ordinary.totalWeight());
+  EXPECT_NEAR(digest.quantile(0.5), ordinary.quantile(0.5), 1.0);
+
+  digest.add(4096.5);
+  EXPECT_FALSE(digest.dense());
+  EXPECT_EQ(100004, digest.totalWeight());
+  digest.compress();
+  EXPECT_LE(digest.processed().size(), digest.maxProcessed());
+  EXPECT_NEAR(ordinary.quantile(0.5), digest.quantile(0.5), 1.0);
+}
+
+TEST_F(TDigestTest, ImportHistograms) {
+  std::random_device gen;
+  std::uniform_real_distribution<> reals(0.0, 160.0);
+
+  std::vector<double> bounds;
+  std::vector<double> cumulative(161, 0.0);
+  for (int i = 1; i <= 160; ++i) bounds.push_back(i);
+  bounds.push_back(INFINITY);
+  std::vector<double> values;
+  for (int i = 0; i < 10000; ++i) {
+    values.push_back(reals(gen));
+    for (size_t b = static_cast<size_t>(std::ceil(values.back())) - 1; b < cumulative.size(); ++b) cumulative[b]++;
+  }
+  std::sort(values.begin(), values.end());
+
+  tdigest::TDigest prometheus(100);
+  prometheus.add(values[0]);
+  prometheus.addCumulativeBuckets(bounds.data(), cumulative.data(), bounds.size(), 0.0);
+  EXPECT_EQ(10001, prometheus.totalWeight());
+  for (double q : {0.1, 0.5, 0.9}) {
+    EXPECT_NEAR(quantile(q, values), prometheus.quantile(q), 1.0) << "q = " << q;
+  }
+
+  // buckets (1, 2], (2, 4], (4, 8] on the positive side and [-2, -1) on the negative side
+  const double counts[] = {1, 2, 3};
+  const double negativeCounts[] = {4};
+  tdigest::TDigest exponential(100);
+  exponential.addExponentialBuckets(0, 0, counts, 3);
+  exponential.addExponentialBuckets(0, 0, negativeCounts, 1, true);
+  exponential.add(0, 5);
+  exponential.compress();
+  EXPECT_EQ(15, exponential.totalWeight());
+  ASSERT_EQ(5, exponential.processed().size());
+  EXPECT_EQ(-1.5, exponential.processed()[0].mean());
+  EXPECT_EQ(0, exponential.processed()[1].mean());
+  EXPECT_EQ(6, exponential.processed()[4].mean());
+
+  const double recorded[] = {10, 20, 30};
+  const double recordedCounts[] = {3, 0, 1};
+  tdigest::TDigest hdr(100);
+  hdr.addHistogram(recorded, recordedCounts, 3);
+  EXPECT_EQ(2, hdr.processed().size());
+  EXPECT_EQ(4, hdr.totalWeight());
+}
+
+TEST_F(TDigestTest, ExportBuckets) {
+  tdigest::TDigest digest(100);
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 2.0);
+  for (int i = 0; i < 100000; ++i) {
+    digest.add(latency(gen) * (i % 10 == 0 ? -1 : 1));
+  }
+
+  std::vector<double> bounds{-10, -1, -0.1, 0, 0.1, 0.5, 1, 2, 5, 10, 100, INFINITY};
+  std::vector<double> cumulative(bounds.size());
+  digest.cumulativeBuckets(bounds.data(), bounds.size(), cumulative.data());
+  for (size_t j = 0; j < bounds.size(); ++j) {
+    EXPECT_NEAR(digest.cdf(bounds[j]) * digest.totalWeight(), cumulative[j], 1e-6) << "bound " << bounds[j];
+  }
+
+  const int scale = 1;
+  const int offset = -8;
+  std::vector<double> counts(32);
+  digest.exponentialBuckets(scale, offset, counts.size(), counts.data());
+  std::vector<double> negativeCounts(32);
+  digest.exponentialBuckets(scale, offset, negativeCounts.size(), negativeCounts.data(), true);
+  for (size_t j = 0; j < counts.size(); ++j) {
+    const double lower = std::pow(std::sqrt(2.0), offset + static_cast<int>(j));
+    const double upper = lower * std::sqrt(2.0);
+    const double expected = (digest.cdf(upper) - digest.cdf(lower)) * digest.totalWeight();
+    const double negativeExpected = (digest.cdf(-lower) - digest.cdf(-upper)) * digest.totalWeight();
+    EXPECT_NEAR(expected, counts[j], 1e-6) << "bucket " << j;
+    EXPECT_NEAR(negativeExpected, negativeCounts[j], 1e-6) << "bucket " << j;
+  }
+
+  // exact tails answer the buckets that fall among them, as they answer cdf()
+  tdigest::TDigest tailed(20);
+  tailed.setTailSize(200);
+  std::vector<double> samples(100000);
+  for (auto& x : samples) {
+    x = latency(gen);
+    tailed.add(x);
+  }
+  std::sort(samples.begin(), samples.end());
+  std::vector<double> tailBounds{samples[10], samples[150], samples[99900]};
+  std::vector<double> tailCumulative(tailBounds.size());
+  tailed.cumulativeBuckets(tailBounds.data(), tailBounds.size(), tailCumulative.data());
+  for (size_t j = 0; j < tailBounds.size(); ++j) {
+    EXPECT_NEAR(tailed.cdf(tailBounds[j]) * tailed.totalWeight(), tailCumulative[j], 1e-6) << "bound " << j;
+  }
+  EXPECT_NEAR(151, tailCumulative[1], 1);
+}
+
+TEST_F(TDigestTest, Moments) {
+  tdigest::TDigest digest1(100);
+  tdigest::TDigest digest2(100);
+  std::random_device gen;
+  std::normal_distribution<> normal(1e6, 10.0);
+
+  std::vector<double> values;
+  for (int i = 0; i < 20000; ++i) {
+    values.push_back(normal(gen));
+    (i % 2 == 0 ? digest1 : digest2).add(values.back());
+  }
+  digest2.add(-5.0, 2);
+  values.push_back(-5.0);
+  values.push_back(-5.0);
+  digest1.merge(&digest2);
+
+  double sum = 0;
+  for (double x : values) sum += x;
+  const double mean = sum / values.size();
+  double m2 = 0;
+  for (double x : values) m2 += (x - mean) * (x - mean);
+
+  const auto& moments = digest1.moments();
+  EXPECT_EQ(values.size(), moments.count());
+  EXPECT_NEAR(sum, moments.sum(), 1e-6 * std::abs(sum));
+  EXPECT_NEAR(mean, moments.mean(), 1e-9 * std::abs(mean));
+  EXPECT_NEAR(m2 / values.size(), moments.variance(), 1e-6 * m2 / values.size());
+  EXPECT_EQ(-5.0, moments.min());
+  EXPECT_EQ(*std::max_element(values.begin(), values.end()), moments.max());
+
+  std::vector<tdigest::Centroid> processed = digest1.processed();
+  std::vector<tdigest::Centroid> unprocessed = digest1.unprocessed();
+  tdigest::TDigest restored(std::move(processed), std::move(unprocessed), 100, 0, 0, digest1.moments());
+  EXPECT_EQ(moments.stddev(), restored.moments().stddev());
+
+  digest1.reset();
+  digest1.compress();
+  EXPECT_EQ(0, digest1.totalWeight());
+  EXPECT_EQ(0, digest1.moments().count());
+  EXPECT_TRUE(std::isnan(digest1.moments().min()));
+  EXPECT_TRUE(std::isnan(digest1.quantile(0.5)));
+}
+
+TEST_F(TDigestTest, ExactTails) {
+  tdigest::TDigest digest1(100);
+  tdigest::TDigest digest2(100);
+  digest1.setTailSize(50);
+  digest2.setTailSize(50);
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+
+  std::vector<double> values;
+  for (int i = 0; i < 100000; ++i) {
+    values.push_back(latency(gen));
+    (i % 2 == 0 ? digest1 : digest2).add(values.back());
+  }
+  digest1.merge(&digest2);
+  std::sort(values.begin(), values.end());
+
+  const double n = values.size();
+  for (double q : {0.0, 1 / n, 10.3 / n, 40 / n, 1 - 40 / n, 1 - 10.3 / n, 1 - 1 / n, 1.0}) {
+    EXPECT_DOUBLE_EQ(quantile(q, values), digest1.quantile(q)) << "q = " << q;
+  }
+  for (int rank : {1, 10, 40}) {
+    const double low = (values[rank] + values[rank + 1]) / 2;
+    const double high = (values[values.size() - rank - 1] + values[values.size() - rank - 2]) / 2;
+    EXPECT_NEAR((rank + 1) / n, digest1.cdf(low), 1e-12) << "rank " << rank;
+    EXPECT_NEAR(1 - (rank + 1) / n, digest1.cdf(high), 1e-12) << "rank " << rank;
+  }
+}
+
+TEST_F(TDigestTest, RangeAggregates) {
+  tdigest::TDigest digest(200);
+  std::random_device gen;
+  std::lognormal_distribution<> latency(3.0, 1.0);
+  std::vector<double> values;
+  for (int i = 0; i < 100000; ++i) {
+    values.push_back(latency(gen));
+    digest.add(values.back());
+  }
+  std::sort(values.begin(), values.end());
+
+  double sum = 0;
+  for (double x : values) sum += x;
+  // the piecewise linear cdf spreads each centroid around its mean, so the mean is only approximately preserved
+  EXPECT_NEAR(1.0, digest.trimmedMean(0, 1) / (sum / values.size()), 1e-2);
+
+  const size_t low = values.size() / 20;
+  const size_t high = values.size() - low;
+  double trimmed = 0;
+  for (size_t i = low; i < high; ++i) trimmed += values[i];
+  trimmed /= (high - low);
+  EXPECT_NEAR(1.0, digest.trimmedMean(0.05, 0.95) / trimmed, 1e-3);
+
+  const double threshold = quantile(0.9, values);
+  double above = 0;
+  for (double x : values) {
+    if (x > threshold) above += x;
+  }
+  EXPECT_NEAR(1.0, digest.sumBetween(threshold, INFINITY) / above, 1e-2);
+  EXPECT_NEAR(digest.trimmedMean(0, 1) * digest.totalWeight(), digest.sumBetween(-INFINITY, INFINITY), 1e-9 * sum);
+
+  for (double x : {5.0, 20.0, 50.0}) {
+    const double expected = (digest.cdf(60.0) - digest.cdf(x)) * digest.totalWeight();
+    EXPECT_NEAR(expected, digest.countBetween(x, 60.0), 1e-6) << "x = " << x;
+  }
+
+  // with exact tails the aggregates integrate the tail samples, as cdf() and quantile() use them
+  tdigest::TDigest tailed(20);
+  tailed.setTailSize(200);
+  for (double x : values) tailed.add(x);
+  EXPECT_NEAR(tailed.cdf(values[150]) * tailed.totalWeight(), tailed.countBetween(-INFINITY, values[150]), 1e-6);
+  EXPECT_NEAR(151, tailed.countBetween(-INFINITY, values[150]), 1);
+  EXPECT_NEAR((1 - tailed.cdf(values[99900])) * tailed.totalWeight(), tailed.countBetween(values[99900], INFINITY),
+              1e-6);
+  double lowest = 0;
+  for (size_t i = 0; i < 100; ++i) lowest += values[i];
+  EXPECT_NEAR(1.0, tailed.trimmedMean(0, 0.001) / (lowest / 100), 1e-2);
+  double highest = 0;
+  for (size_t i = values.size() - 100; i < values.size(); ++i) highest += values[i];
+  EXPECT_NEAR(1.0, tailed.sumBetween(values[values.size() - 101], INFINITY) / highest, 1e-2);
+}
+
+TEST_F(TDigestTest, DistributionDistances) {
+  tdigest::TDigest baseline(200);
+  tdigest::TDigest shifted(200);
+  std::random_device gen;
+  std::uniform_real_distribution<> reals(0.0, 1.0);
+  for (int i = 0; i < 100000; ++i) {
+    baseline.add(reals(gen));
+    shifted.add(reals(gen) + 0.25);
+  }
+  baseline.compress();
+  shifted.compress();
+
+  EXPECT_EQ(0.0, tdigest::TDigest::ksDistance(baseline, baseline));
+  EXPECT_EQ(0.0, tdigest::TDigest::wasserstein1(baseline, baseline));
+  EXPECT_NEAR(0.5, tdigest::TDigest::probabilityLess(baseline, baseline), 1e-9);
+
+  // for U(0, 1) against U(0.25, 1.25): KS = 0.25, W1 = 0.25 and P[X < Y] = 1 - 0.75^2 / 2
+  EXPECT_NEAR(0.25, tdigest::TDigest::ksDistance(baseline, shifted), 0.01);
+  EXPECT_NEAR(0.25, tdigest::TDigest::wasserstein1(baseline, shifted), 0.01);
+  EXPECT_NEAR(1 - 0.75 * 0.75 / 2, tdigest::TDigest::probabilityLess(baseline, shifted), 0.01);
+  EXPECT_NEAR(1.0, tdigest::TDigest::probabilityLess(baseline, shifted) +
+                       tdigest::TDigest::probabilityLess(shifted, baseline), 1e-9);
+
+  double ks = 0;
+  for (double x = -0.5; x <= 1.5; x += 1e-4) {
+    ks = std::max(ks, std::abs(baseline.cdf(x) - shifted.cdf(x)));
+  }
+  EXPECT_NEAR(ks, tdigest::TDigest::ksDistance(baseline, shifted), 1e-3);
+
+  // exact tails are part of the compared cdfs, up to a few samples where the centroid cdf joins the tails
+  tdigest::TDigest coarse(20);
+  tdigest::TDigest tailed(20);
+  tailed.setTailSize(200);
+  std::vector<double> samples(100000);
+  for (auto& x : samples) {
+    x = reals(gen);
+    coarse.add(x);
+    tailed.add(x);
+  }
+  coarse.compress();
+  tailed.compress();
+  double tailKs = 0;
+  for (double sample : samples) {
+    for (double x : {sample, std::nextafter(sample, -INFINITY)}) {
+      tailKs = std::max(tailKs, std::abs(coarse.cdf(x) - tailed.cdf(x)));
+    }
+  }
+  EXPECT_GT(tailKs, 1e-4);
+  EXPECT_NEAR(tailKs, tdigest::TDigest::ksDistance(coarse, tailed), 1e-4);
+}
+
+TEST_F(TDigestTest, ThresholdWatchers) {
+  tdigest::TDigest digest(100);
+  std::random_device gen;
+  std::uniform_real_distribution<> reals(0.0, 1.0);
+  for (int i = 0; i < 10000; ++i) {
+    digest.add(reals(gen));
+  }
+  digest.compress();
+
+  const auto slow = digest.watch(0.9);
+  const auto fast = digest.watch(0.1);
+  EXPECT_NEAR(1 - digest.cdf(0.9), digest.fractionAbove(slow), 1e-12);
+
+  // a burst of slow requests is visible exactly, before any compaction
+  for (int i = 0; i < 100; ++i) {
+    digest.add(2.0);
+  }
+  EXPECT_TRUE(digest.haveUnprocessed());
+  const double above = (1 - digest.cdfProcessed(0.9)) * digest.processedWeight() + 100;
+  EXPECT_NEAR(above, digest.weightAbove(slow), 1e-9);
+  EXPECT_TRUE(digest.haveUnprocessed());
+
+  tdigest::TDigest other(100);
+  other.add(0.5, 50);
+  digest.merge(&other);
+  for (auto watcher : {slow, fast}) {
+    const double threshold = (watcher == slow) ? 0.9 : 0.1;
+    EXPECT_NEAR(1 - digest.cdf(threshold), digest.fractionAbove(watcher), 1e-3) << "threshold " << threshold;
+  }
+
+  // dense digests merge their counts exactly, watchers included
+  tdigest::TDigest counts(100);
+  counts.setDenseDomain(0, 100);
+  for (int i = 0; i < 100; ++i) counts.add(i);
+  const auto half = counts.watch(50);
+  tdigest::TDigest more(100);
+  more.setDenseDomain(0, 100);
+  more.add(90, 100);
+  counts.merge(&more);
+  EXPECT_EQ(149, counts.weightAbove(half));
+  EXPECT_DOUBLE_EQ(0.745, counts.fractionAbove(half));
+
+  // a sample outside the domain ends dense mode without going missing
+  tdigest::TDigest leaving(100);
+  leaving.setDenseDomain(0, 100);
+  for (int i = 0; i < 100; ++i) leaving.add(i);
+  const auto upper = leaving.watch(50);
+  leaving.add(500);
+  EXPECT_TRUE(leaving.haveUnprocessed());
+  const double pending = (1 - leaving.cdfProcessed(50)) * leaving.processedWeight() + 1;
+  EXPECT_NEAR(pending, leaving.weightAbove(upper), 1e-9);
+}
+
+TEST_F(TDigestTest, SplitPoints) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest parts[3] = {tdigest::TDigest(100), tdigest::TDigest(100), tdigest::TDigest(100)};
+  tdigest::TDigest merged(100);
+  for (int i = 0; i < 60000; ++i) {
+    const double x = latency(gen) * (1 + i % 3);
+    parts[i % 3].add(x);
+    merged.add(x);
+  }
+  for (auto& part : parts) part.compress();
+
+  const size_t k = 16;
+  std::vector<double> splits(k - 1);
+  merged.splitPoints(k, splits.data());
+  for (size_t j = 1; j < k; ++j) {
+    EXPECT_EQ(merged.quantile(static_cast<double>(j) / k), splits[j - 1]) << "j = " << j;
+  }
+
+  std::vector<const tdigest::TDigest*> one{&parts[0]};
+  std::vector<double> single(k - 1);
+  parts[0].splitPoints(k, single.data());
+  tdigest::TDigest::splitPoints(one, nullptr, k, splits.data());
+  for (size_t j = 0; j < k - 1; ++j) {
+    EXPECT_NEAR(single[j], splits[j], 1e-9 * single[j]) << "j = " << j;
+  }
+
+  std::vector<const tdigest::TDigest*> all{&parts[0], &parts[1], &parts[2]};
+  tdigest::TDigest::splitPoints(all, nullptr, k, splits.data());
+  for (size_t j = 1; j < k; ++j) {
+    EXPECT_NEAR(1.0, splits[j - 1] / merged.quantile(static_cast<double>(j) / k), 0.03) << "j = " << j;
+  }
+
+  // within exact tails both walks follow the tail samples
+  tdigest::TDigest tailed(20);
+  tailed.setTailSize(200);
+  for (int i = 0; i < 100000; ++i) tailed.add(latency(gen));
+  const size_t fine = 1000;
+  std::vector<double> tailedSingle(fine - 1);
+  std::vector<double> tailedMulti(fine - 1);
+  tailed.splitPoints(fine, tailedSingle.data());
+  std::vector<const tdigest::TDigest*> alone{&tailed};
+  tdigest::TDigest::splitPoints(alone, nullptr, fine, tailedMulti.data());
+  for (size_t j = 0; j < fine - 1; ++j) {
+    EXPECT_NEAR(tailedSingle[j], tailedMulti[j], 1e-9 * tailedSingle[j]) << "j = " << j;
+  }
+
+  // weighting the first part by zero leaves the boundaries of the other two
+  const double weights[] = {0, 1, 1};
+  std::vector<const tdigest::TDigest*> rest{&parts[1], &parts[2]};
+  std::vector<double> expected(k - 1);
+  tdigest::TDigest::splitPoints(rest, nullptr, k, expected.data());
+  tdigest::TDigest::splitPoints(all, weights, k, splits.data());
+  for (size_t j = 0; j < k - 1; ++j) {
+    EXPECT_NEAR(expected[j], splits[j], 1e-9 * expected[j]) << "j = " << j;
+  }
+}
+
+TEST_F(TDigestTest, MonotoneCursor) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest digest(100);
+  digest.setTailSize(8);
+  for (int i = 0; i < 50000; ++i) {
+    digest.add(latency(gen));
+  }
+
+  auto cursor = digest.cursor();
+  for (int i = 0; i <= 1000; ++i) {
+    const double q = i / 1000.0;
+    EXPECT_EQ(digest.quantile(q), cursor.quantile(q)) << "q = " << q;
+    const double x = digest.moments().min() + (digest.moments().max() - digest.moments().min()) * q * q;
+    EXPECT_EQ(digest.cdf(x), cursor.cdf(x)) << "x = " << x;
+  }
+
+  // going backwards restarts the search
+  EXPECT_EQ(digest.quantile(0.25), cursor.quantile(0.25));
+  EXPECT_EQ(digest.cdf(1.0), cursor.cdf(1.0));
+}
+
+TEST_F(TDigestTest, Sampler) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest digest(100);
+  digest.setTailSize(8);
+  for (int i = 0; i < 50000; ++i) {
+    digest.add(latency(gen));
+  }
+  digest.compress();
+
+  tdigest::TDigest::Sampler sampler(digest);
+  for (int i = 0; i <= 10000; ++i) {
+    const double q = i / 10000.0;
+    const double expected = digest.quantile(q);
+    EXPECT_NEAR(expected, sampler.at(q), 1e-9 * std::max(1.0, expected)) << "q = " << q;
+  }
+
+  std::mt19937_64 rng(42);
+  std::vector<double> samples(200000);
+  sampler.sample(samples.data(), samples.size(), rng);
+  tdigest::TDigest replay(100);
+  for (double x : samples) replay.add(x);
+  replay.compress();
+  EXPECT_LT(tdigest::TDigest::ksDistance(digest, replay), 0.01);
+
+  tdigest::TDigest empty(100);
+  EXPECT_TRUE(std::isnan(tdigest::TDigest::Sampler(empty).sample(rng)));
+}
+
+TEST_F(TDigestTest, MergeCache) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  std::vector<std::unique_ptr<tdigest::TDigest>> digests;
+  for (int d = 0; d < 4; ++d) {
+    digests.emplace_back(new tdigest::TDigest(100));
+    for (int i = 0; i < 5000; ++i) digests.back()->add(latency(gen));
+    digests.back()->compress();
+  }
+
+  // the fingerprint follows the content, not the object
+  tdigest::TDigest copy(100);
+  copy.merge(digests[0].get());
+  copy.compress();
+  EXPECT_NE(digests[0]->fingerprint(), digests[1]->fingerprint());
+  const auto before = copy.fingerprint();
+  copy.add(1.0);
+  copy.compress();
+  EXPECT_NE(before, copy.fingerprint());
+
+  tdigest::MergeCache cache(100, 2);
+  auto first = cache.merge({digests[0].get(), digests[1].get()});
+  auto again = cache.merge({digests[1].get(), digests[0].get()});
+  EXPECT_EQ(first.get(), again.get());
+  EXPECT_EQ(1, cache.hits());
+
+  tdigest::TDigest direct(100);
+  direct.add({digests[0].get(), digests[1].get()});
+  EXPECT_EQ(direct.quantile(0.9), first->quantileProcessed(0.9));
+
+  // a changed input misses, and the least recently used result is dropped
+  cache.merge({digests[2].get(), digests[3].get()});
+  digests[0]->add(1.0);
+  digests[0]->compress();
+  auto changed = cache.merge({digests[0].get(), digests[1].get()});
+  EXPECT_NE(first.get(), changed.get());
+  EXPECT_EQ(2, cache.size());
+  cache.merge({digests[2].get(), digests[3].get()});
+  EXPECT_EQ(2, cache.hits());
+}
+
+TEST_F(TDigestTest, Generations) {
+  tdigest::TDigest digest(100);
+  auto seen = digest.generation();
+  digest.add(1.0);
+  EXPECT_LT(seen, digest.generation());
+  seen = digest.generation();
+  digest.quantileProcessed(0.5);
+  EXPECT_EQ(seen, digest.generation());
+  digest.compress();
+  EXPECT_LT(seen, digest.generation());
+
+  tdigest::KeyedTDigest<std::string> digests(100);
+  digests.add("a", 1.0);
+  digests.add("b", 2.0);
+  const auto exported = digests.generation();
+  EXPECT_TRUE(digests.changedSince(exported).empty());
+
+  digests.add("a", 3.0);
+  digests.add("c", 4.0);
+  digests.merge("a", digests.find("b"));
+  EXPECT_EQ((std::vector<std::string>{"c", "a"}), digests.changedSince(exported));
+  EXPECT_EQ((std::vector<std::string>{"b", "c", "a"}), digests.changedSince(0));
+  EXPECT_EQ(3, digests.find("a")->totalWeight());
+  EXPECT_EQ(nullptr, digests.find("d"));
+}
+
+TEST_F(TDigestTest, ScaleWeights) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest sampled(100);
+  tdigest::TDigest full(100);
+  for (int i = 0; i < 20000; ++i) {
+    const double x = latency(gen);
+    sampled.add(x);
+    full.add(x, 10);
+  }
+  sampled.compress();
+  full.compress();
+
+  // a 10% sample scaled back up reports the weights of the full stream and the same quantiles
+  const double median = sampled.quantile(0.5);
+  sampled.scaleWeights(10);
+  EXPECT_EQ(median, sampled.quantile(0.5));
+  EXPECT_EQ(200000, sampled.totalWeight());
+  EXPECT_NEAR(200000, sampled.moments().count(), 1e-6);
+  EXPECT_NEAR(full.moments().sum(), sampled.moments().sum(), 1e-9 * full.moments().sum());
+  EXPECT_NEAR(full.countBetween(0, 1), sampled.countBetween(0, 1), 1e-6 * full.countBetween(0, 1));
+
+  // merging applies the scale of the source and the extra factor
+  tdigest::TDigest rollup(100);
+  rollup.merge(&sampled, 0.5);
+  EXPECT_EQ(100000, rollup.totalWeight());
+  EXPECT_NEAR(median, rollup.quantile(0.5), 1e-9 * median);
+
+  // samples added after scaling keep their own weight
+  sampled.add(1000.0, 100);
+  EXPECT_EQ(200100, sampled.totalWeight());
+  EXPECT_EQ(1000.0, sampled.quantile(1));
+}
+
+TEST_F(TDigestTest, TransformValues) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest nanos(100);
+  tdigest::TDigest millis(100);
+  for (int i = 0; i < 20000; ++i) {
+    const double x = latency(gen) * 1e6;
+    nanos.add(x);
+    millis.add(x / 1e6 + 5);
+  }
+  nanos.compress();
+  millis.compress();
+  const auto above = nanos.watch(2e6);
+
+  // nanoseconds to milliseconds, shifted by 5ms of clock skew
+  nanos.transformValues(1e-6, 5);
+  for (double q : {0.0, 0.01, 0.5, 0.99, 1.0}) {
+    EXPECT_NEAR(millis.quantile(q), nanos.quantile(q), 1e-9 * millis.quantile(q)) << "q = " << q;
+  }
+  EXPECT_NEAR(millis.cdf(6), nanos.cdf(6), 1e-12);
+  EXPECT_NEAR(millis.moments().mean(), nanos.moments().mean(), 1e-9 * millis.moments().mean());
+  EXPECT_NEAR(millis.moments().variance(), nanos.moments().variance(), 1e-9 * millis.moments().variance());
+  EXPECT_NEAR(nanos.weightAbove(above), nanos.countBetween(7, INFINITY), 1e-6 * nanos.totalWeight());
+
+  // merges fold the source transform in, and new samples are taken in the transformed units
+  tdigest::TDigest rollup(100);
+  rollup.merge(&nanos);
+  EXPECT_NEAR(millis.quantile(0.5), rollup.quantile(0.5), 1e-9 * millis.quantile(0.5));
+  nanos.add(1000.0, 20000);
+  EXPECT_EQ(1000.0, nanos.quantile(1));
+  EXPECT_EQ(40000, nanos.totalWeight());
+  EXPECT_NEAR(millis.quantile(0.5), nanos.quantile(0.25), 0.05 * millis.quantile(0.5));
+
+  // merging into a populated digest interleaves the transformed means with the existing ones
+  tdigest::TDigest scaled(100);
+  tdigest::TDigest populated(100);
+  for (int i = 0; i < 1000; ++i) {
+    scaled.add(i);
+    populated.add(500 + 1000 * i);
+  }
+  scaled.transformValues(1000, 0);
+  populated.merge(&scaled);
+  const auto& merged = populated.processed();
+  EXPECT_TRUE(std::is_sorted(merged.cbegin(), merged.cend(), tdigest::CentroidComparator()));
+  EXPECT_NEAR(250000, populated.quantile(0.25), 2500);
+  EXPECT_NEAR(500000, populated.quantile(0.5), 2500);
+  EXPECT_NEAR(0.75, populated.cdf(750000), 0.005);
+
+  // reset drops the transform but not what the watchers watch
+  tdigest::TDigest doubled(100);
+  doubled.transformValues(2, 0);
+  const auto overThousand = doubled.watch(1000);
+  doubled.reset();
+  for (int i = 0; i < 1000; ++i) doubled.add(i);
+  doubled.compress();
+  EXPECT_EQ(0, doubled.weightAbove(overThousand));
+}
+
+TEST_F(TDigestTest, LogDomain) {
+  std::mt19937_64 gen(7);
+  std::lognormal_distribution<> latency(0.0, 2.5);
+  std::vector<double> input(200000);
+  for (auto& x : input) x = latency(gen);
+  std::vector<double> sorted = input;
+  std::sort(sorted.begin(), sorted.end());
+
+  tdigest::TDigest linear(100);
+  tdigest::TDigest log(100);
+  log.setLogDomain(1e-6);
+  for (double x : input) {
+    linear.add(x);
+    log.add(x);
+  }
+
+  // the same number of centroids gives better relative accuracy across the range
+  double linearWorst = 0;
+  double logWorst = 0;
+  for (double q : {0.01, 0.1, 0.5, 0.9, 0.99, 0.999}) {
+    const double exact = sorted[static_cast<size_t>(q * (sorted.size() - 1))];
+    linearWorst = std::max(linearWorst, std::abs(linear.quantile(q) - exact) / exact);
+    logWorst = std::max(logWorst, std::abs(log.quantile(q) - exact) / exact);
+  }
+  EXPECT_LT(logWorst, linearWorst);
+  EXPECT_LT(logWorst, 0.05);
+  EXPECT_NEAR(0.5, log.cdf(log.quantile(0.5)), 1e-9);
+
+  double sum = 0;
+  for (double x : input) sum += x;
+  EXPECT_NEAR(sum, log.moments().sum(), 1e-9 * sum);
+  EXPECT_NEAR(sum, log.sumBetween(-INFINITY, INFINITY), 0.1 * sum);
+
+  // zero and negative values map through the same increasing function
+  tdigest::TDigest signs(100);
+  signs.setLogDomain(1.0);
+  for (double x : {-1000.0, -1.0, 0.0, 0.0, 1.0, 1000.0}) signs.add(x);
+  EXPECT_NEAR(-1000.0, signs.quantile(0), 1e-9);
+  EXPECT_NEAR(0.0, signs.quantile(0.5), 1e-12);
+  EXPECT_NEAR(1000.0, signs.quantile(1), 1e-9);
+
+  // merging into a linear digest maps the values back
+  tdigest::TDigest merged(100);
+  merged.merge(&log);
+  EXPECT_NEAR(log.quantile(0.5), merged.quantile(0.5), 0.01 * log.quantile(0.5));
+  EXPECT_EQ(log.totalWeight(), merged.totalWeight());
+}
+
+TEST_F(TDigestTest, Downsample) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest local(1000);
+  for (int i = 0; i < 100000; ++i) {
+    local.add(latency(gen));
+  }
+  local.compress();
+
+  tdigest::TDigest wire(100);
+  local.downsample(&wire);
+  EXPECT_EQ(local.totalWeight(), wire.totalWeight());
+  EXPECT_LE(wire.processed().size(), wire.maxProcessed());
+  for (double q : {0.01, 0.1, 0.5, 0.9, 0.99}) {
+    EXPECT_NEAR(1.0, wire.quantile(q) / local.quantile(q), 0.02) << "q = " << q;
+  }
+
+  local.downsample(100);
+  EXPECT_EQ(100, local.compression());
+  EXPECT_EQ(wire.processed().size(), local.processed().size());
+  EXPECT_EQ(wire.quantile(0.9), local.quantile(0.9));
+  EXPECT_EQ(wire.totalWeight(), local.totalWeight());
+}
+
+TEST_F(TDigestTest, MergeBoundsProcessed) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  std::vector<std::unique_ptr<tdigest::TDigest>> parts;
+  std::vector<const tdigest::TDigest*> inputs;
+  tdigest::TDigest all(100);
+  for (int d = 0; d < 20; ++d) {
+    parts.emplace_back(new tdigest::TDigest(d % 2 == 0 ? 1000 : 300));
+    for (int i = 0; i < 10000; ++i) {
+      const double x = latency(gen);
+      parts.back()->add(x);
+      all.add(x);
+    }
+    parts.back()->compress();
+    inputs.push_back(parts.back().get());
+  }
+
+  // the inputs hold far more centroids than the receiver may, yet it never holds more than maxProcessed
+  tdigest::TDigest merged(100);
+  merged.add(inputs);
+  EXPECT_LE(merged.processed().size(), merged.maxProcessed());
+  EXPECT_EQ(all.totalWeight(), merged.totalWeight());
+  for (double q : {0.001, 0.01, 0.5, 0.99, 0.999}) {
+    EXPECT_NEAR(1.0, merged.quantile(q) / all.quantile(q), 0.05) << "q = " << q;
+  }
+}
+
+TEST_F(TDigestTest, StrictBound) {
+  std::random_device gen;
+  std::lognormal_distribution<> latency(0.0, 1.0);
+  tdigest::TDigest loose(100, 0, 40);
+  tdigest::TDigest strict(100, 0, 40);
+  strict.setStrictBound(true);
+  size_t looseMost = 0;
+  for (int i = 0; i < 1000; ++i) {
+    const double x = latency(gen);
+    loose.add(x);
+    strict.add(x);
+    looseMost = std::max(looseMost, loose.processed().size());
+    ASSERT_LE(strict.processed().size(), strict.maxProcessed());
+  }
+  EXPECT_GT(looseMost, loose.maxProcessed());
+
+  // merges and imports are held to the bound too
+  tdigest::TDigest wide(1000);
+  for (int i = 0; i < 20000; ++i) wide.add(latency(gen));
+  strict.merge(&wide);
+  EXPECT_LE(strict.processed().size(), strict.maxProcessed());
+  std::vector<double> values(1000);
+  std::vector<double> counts(1000, 1.0);
+  for (size_t i = 0; i < values.size(); ++i) values[i] = i / 100.0;
+  strict.addHistogram(values.data(), counts.data(), values.size());
+  EXPECT_LE(strict.processed().size(), strict.maxProcessed());
+  EXPECT_EQ(22000, strict.totalWeight());
+  EXPECT_NEAR(1.0, strict.quantile(0.5) / wide.quantile(0.5), 0.1);
+}
+
+TEST_F(TDigestTest, AdaptiveCompression) {
+  std::random_device gen;
+  std::uniform_real_distribution<> uniform(0.0, 1.0);
+
+  // an error target lowers an overly fine digest and raises a coarse one that misses it
+  auto accurate = tdigest::CompressionController::forError(0.005);
+  tdigest::TDigest fine(1000);
+  tdigest::TDigest coarse(50);
+  for (int i = 0; i < 50000; ++i) {
+    fine.add(uniform(gen));
+    coarse.add(uniform(gen));
+  }
+  coarse.compress();
+  EXPECT_GT(coarse.rankError(), 0.005);
+  EXPECT_TRUE(accurate.adjust(&fine));
+  EXPECT_TRUE(accurate.adjust(&coarse));
+  EXPECT_NEAR(accurate.target(), fine.compression(), 1e-9);
+  EXPECT_NEAR(accurate.target(), coarse.compression(), 1e-9);
+  EXPECT_LT(fine.rankError(), 0.01);
+  EXPECT_FALSE(accurate.adjust(&fine));
+  EXPECT_NEAR(0.5, fine.quantile(0.5), 0.01);
+
+  // a byte budget shared by keys favours the hot one and is met once both are recompressed
+  tdigest::KeyedTDigest<std::string> digests(500);
+  for (int i = 0; i < 40000; ++i) digests.add("hot", uniform(gen));
+  for (int i = 0; i < 400; ++i) digests.add("cold", uniform(gen));
+  const size_t budget = tdigest::TDigest::memoryBytes(200) + tdigest::TDigest::memoryBytes(40);
+  auto bounded = tdigest::CompressionController::forBudget(budget);
+  const uint64_t before = digests.generation();
+  EXPECT_EQ(2, bounded.adjust(&digests));
+  EXPECT_GT(digests.generation(), before);
+  const tdigest::TDigest* hot = digests.find("hot");
+  const tdigest::TDigest* cold = digests.find("cold");
+  EXPECT_GT(hot->compression(), 5 * cold->compression());
+  EXPECT_LE(tdigest::TDigest::memoryBytes(hot->compression()) + tdigest::TDigest::memoryBytes(cold->compression()),
+            budget * 1.01);
+  EXPECT_EQ(40000, hot->totalWeight());
+  EXPECT_EQ(0, bounded.adjust(&digests));
+  EXPECT_EQ(std::vector<std::string>({"cold", "hot"}), digests.keys());
+  digests.downsample("missing", 50);
+  EXPECT_EQ(nullptr, digests.find("missing"));
+  EXPECT_EQ(2, digests.size());
+}
+
 }  // namespace stesting
 
 int main(int argc, char** argv) {